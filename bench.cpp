@@ -0,0 +1,227 @@
+#define EXT_NO_MAIN
+#include "main.cpp"
+
+#define BENCH_INPUT_NAME "bench.input.bin"
+#define BENCH_OUTPUT_NAME "bench.output.bin"
+
+// micro-benchmarks of the external operators in isolation:
+// ./ext_bench [records] [operator filter: sort|join|mjoin|hjoin|map]
+// every line is: operator, tuple width, memory budget, merge rank, input ordering, records, seconds, throughput
+
+enum ordering_t {
+    RANDOM, SORTED, REVERSED
+};
+
+static const char *const ordering_names[] = {"random", "sorted", "reversed"};
+
+template<size_t len>
+static source_t<tuple<uint32_t, len>> generated(elements_size_t size, ordering_t ordering) {
+    auto i = std::make_shared<elements_size_t>(0);
+
+    return [i, size, ordering](tuple<uint32_t, len> &val) {
+        if (*i == size) {
+            return false;
+        }
+        auto k = static_cast<uint32_t>(*i);
+        switch (ordering) {
+            case SORTED:
+                val.elem[0] = k;
+                break;
+            case REVERSED:
+                val.elem[0] = static_cast<uint32_t>(size - 1 - k);
+                break;
+            default:
+                val.elem[0] = static_cast<uint32_t>(priority(0xbe7c4ull, k));
+        }
+        for (size_t c = 1; c < len; c++) {
+            val.elem[c] = k;
+        }
+        ++*i;
+        return true;
+    };
+}
+
+static void print_result(
+        const char *op, size_t width, size_t budget, size_t rank, const char *ordering,
+        elements_size_t records, size_t record_size, uint64_t ns) {
+    double seconds = ns / 1e9;
+
+    printf("%-5s %-6s %10zu %5zu %-9s %10llu %9.3f s %12.0f rec/s %9.1f MB/s\n",
+           op, (width == 2) ? "pair" : (width == 3) ? "three" : (width == 4) ? "four" : (width == 6) ? "six"
+                   : (width == 7) ? "seven" : (width == 8) ? "eight" : "nine",
+           budget, rank, ordering, (unsigned long long) records, seconds,
+           records / seconds, records * record_size / seconds / (1 << 20));
+    fflush(stdout);
+}
+
+template<size_t len>
+static void bench_sort(elements_size_t records, size_t budget, size_t rank, ordering_t ordering) {
+    typedef tuple<uint32_t, len> record_t;
+    auto *ram = new char[budget];
+    merger_t<record_t> merger(ram, budget);
+
+    uint64_t start = io_stats_t::now_ns();
+    merger.sort(generated<len>(records, ordering), BENCH_OUTPUT_NAME, key_by<uint32_t, 0>(), rank);
+    print_result("sort", len, budget, rank, ordering_names[ordering], records, sizeof(record_t),
+                 io_stats_t::now_ns() - start);
+    delete[] ram;
+}
+
+template<size_t len>
+static void bench_join(elements_size_t records, size_t budget) {
+    typedef tuple<uint32_t, len> record_t;
+    auto *ram = new char[budget];
+    joiner_t<record_t, record_t, record_t> joiner(ram, budget);
+
+    write_to<record_t>(generated<len>(records, SORTED), BENCH_INPUT_NAME, ram, budget);
+    uint64_t start = io_stats_t::now_ns();
+    joiner.join(BENCH_INPUT_NAME, BENCH_INPUT_NAME, BENCH_OUTPUT_NAME,
+                [](const record_t &left, const record_t &right, record_t &result) {
+                    result = left;
+                    result.elem[len - 1] = right.elem[0];
+                    return true;
+                });
+    print_result("join", len, budget, 0, "sorted", records, 2 * sizeof(record_t), io_stats_t::now_ns() - start);
+    delete[] ram;
+}
+
+// many-to-many merge join of streams, every left key matches four right records
+template<size_t len>
+static void bench_merge_join(elements_size_t records, size_t budget) {
+    typedef tuple<uint32_t, len> record_t;
+    typedef joiner_t<record_t, record_t, record_t> joiner;
+    auto *ram = new char[budget];
+    size_t stream_size = budget / 4;
+
+    write_to<record_t>(generated<len>(records, SORTED), BENCH_INPUT_NAME, ram, budget);
+    uint64_t start = io_stats_t::now_ns();
+    write_to<record_t>(
+            joiner::template merge_join<key_by<uint32_t, 0>, key_by<uint32_t, 0>>(
+                    mapper_t<record_t, record_t>::map(
+                            file_source<record_t>(BENCH_INPUT_NAME, ram, stream_size),
+                            [](const record_t &src, record_t &target) {
+                                target = src;
+                                target.elem[0] /= 4;
+                                return (src.elem[0] % 4) == 0;
+                            }),
+                    mapper_t<record_t, record_t>::map(
+                            file_source<record_t>(BENCH_INPUT_NAME, ram + stream_size, stream_size),
+                            [](const record_t &src, record_t &target) {
+                                target = src;
+                                target.elem[0] /= 4;
+                                return true;
+                            }),
+                    [](const record_t &left, const record_t *right, record_t &result) {
+                        result = left;
+                        result.elem[len - 1] = (right != nullptr) ? right->elem[1] : 0;
+                        return true;
+                    },
+                    ram + 3 * stream_size, stream_size),
+            BENCH_OUTPUT_NAME, ram + 2 * stream_size, stream_size);
+    print_result("mjoin", len, budget, 0, "sorted", records, 2 * sizeof(record_t), io_stats_t::now_ns() - start);
+    delete[] ram;
+}
+
+// hash join of a random-order stream against a table of all records, the table gets its own ram
+template<size_t len>
+static void bench_hash_join(elements_size_t records, size_t budget) {
+    typedef tuple<uint32_t, len> record_t;
+    typedef joiner_t<record_t, record_t, record_t> joiner;
+    typedef hash_table_t<record_t, key_by<uint32_t, 0>> table_t;
+    auto *ram = new char[budget];
+    size_t table_size = static_cast<size_t>(records) * (sizeof(record_t) + 1) / 7 * 8 + 64;
+    auto *table_ram = new char[table_size];
+    size_t stream_size = budget / 2;
+    table_t table(table_ram, table_size);
+
+    write_to<record_t>(generated<len>(records, RANDOM), BENCH_INPUT_NAME, ram, budget);
+    uint64_t start = io_stats_t::now_ns();
+    {
+        auto source = generated<len>(records, RANDOM);
+        for (record_t r{}; source(r);) {
+            table.insert(r);
+        }
+    }
+    write_to<record_t>(
+            joiner::template hash_join<key_by<uint32_t, 0>>(
+                    file_source<record_t>(BENCH_INPUT_NAME, ram, stream_size),
+                    &table,
+                    [](const record_t &left, const record_t *right, record_t &result) {
+                        result = left;
+                        result.elem[len - 1] = (right != nullptr) ? right->elem[1] : 0;
+                        return true;
+                    }),
+            BENCH_OUTPUT_NAME, ram + stream_size, stream_size);
+    print_result("hjoin", len, budget, 0, "random", records, 2 * sizeof(record_t), io_stats_t::now_ns() - start);
+    delete[] table_ram;
+    delete[] ram;
+}
+
+template<size_t len>
+static void bench_map(elements_size_t records, size_t budget) {
+    typedef tuple<uint32_t, len> record_t;
+    auto *ram = new char[budget];
+    mapper_t<record_t, record_t> mapper(ram, budget);
+
+    write_to<record_t>(generated<len>(records, RANDOM), BENCH_INPUT_NAME, ram, budget);
+    uint64_t start = io_stats_t::now_ns();
+    mapper.map(BENCH_INPUT_NAME, BENCH_OUTPUT_NAME, [](const record_t &src, record_t &target) {
+        target = src;
+        target.elem[0]++;
+        return true;
+    });
+    print_result("map", len, budget, 0, "random", records, sizeof(record_t), io_stats_t::now_ns() - start);
+    delete[] ram;
+}
+
+template<size_t len>
+static void bench_width(elements_size_t records, const char *filter) {
+    static const size_t budget = 1 << 20;
+
+    if ((filter == nullptr) || !strcmp(filter, "sort")) {
+        for (int ordering = RANDOM; ordering <= REVERSED; ordering++) {
+            bench_sort<len>(records, budget, 0, static_cast<ordering_t>(ordering));
+        }
+    }
+    if ((filter == nullptr) || !strcmp(filter, "join")) {
+        bench_join<len>(records, budget);
+    }
+    if ((filter == nullptr) || !strcmp(filter, "mjoin")) {
+        bench_merge_join<len>(records, budget);
+    }
+    if ((filter == nullptr) || !strcmp(filter, "hjoin")) {
+        bench_hash_join<len>(records, budget);
+    }
+    if ((filter == nullptr) || !strcmp(filter, "map")) {
+        bench_map<len>(records, budget);
+    }
+}
+
+int main(int argc, char const *argv[]) {
+    elements_size_t records = (argc > 1) ? strtoull(argv[1], nullptr, 10) : (1 << 20);
+    const char *filter = (argc > 2) ? argv[2] : nullptr;
+
+    printf("%-5s %-6s %10s %5s %-9s %10s %11s %18s %14s\n",
+           "op", "tuple", "budget", "rank", "order", "records", "time", "records/s", "MB/s");
+
+    bench_width<2>(records, filter);
+    bench_width<3>(records, filter);
+    bench_width<4>(records, filter);
+    bench_width<6>(records, filter);
+    bench_width<7>(records, filter);
+    bench_width<8>(records, filter);
+    bench_width<9>(records, filter);
+
+    // memory budget against merge rank, where the number of merge passes changes
+    if ((filter == nullptr) || !strcmp(filter, "sort")) {
+        for (size_t budget : {size_t(64) << 10, size_t(1) << 20, size_t(16) << 20}) {
+            for (size_t rank : {size_t(2), size_t(8), size_t(64), size_t(0)}) {
+                bench_sort<3>(records, budget, rank, RANDOM);
+            }
+        }
+    }
+
+    remove(BENCH_INPUT_NAME);
+    remove(BENCH_OUTPUT_NAME);
+    return EXIT_SUCCESS;
+}
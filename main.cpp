@@ -3,19 +3,87 @@
 #include <cstdint>
 #include <cstring>
 #include <cassert>
+#include <cctype>
 #include <cmath>
 #include <queue>
 #include <algorithm>
 #include <functional>
 #include <stack>
-#include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <ctime>
+#include <vector>
+#include <map>
+#include <limits>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
 
 #ifndef DEFAULT_MEMORY_SIZE
 #define DEFAULT_MEMORY_SIZE (204800)
 #endif
 
 #ifndef DEFAULT_MERGE_RANK
-#define DEFAULT_MERGE_RANK 8
+#define DEFAULT_MERGE_RANK 0 // pick at run time
+#endif
+
+#ifndef DEFAULT_MIN_MERGE_BLOCK_SIZE
+#define DEFAULT_MIN_MERGE_BLOCK_SIZE 4096
+#endif
+
+#ifndef DEFAULT_SEEK_BYTES
+#define DEFAULT_SEEK_BYTES (16 << 10) // bytes the disk transfers in the time of one seek, unless measured
+#endif
+
+#ifndef DEFAULT_THREADS
+#define DEFAULT_THREADS 0 // one per core
+#endif
+
+#ifndef DEFAULT_ASYNC_IO
+#define DEFAULT_ASYNC_IO 1
+#endif
+
+#ifndef DEFAULT_MAPPED_IO
+#define DEFAULT_MAPPED_IO 0 // read files through mmap windows instead of fread
+#endif
+
+#ifndef DEFAULT_PROGRESS
+#define DEFAULT_PROGRESS 0 // print each finished stage of the report to stderr, --progress or EXT_PROGRESS=1
+#endif
+
+#ifndef DEFAULT_SHARDS
+#define DEFAULT_SHARDS 1 // worker processes splitting every level by id range, --shards= or EXT_SHARDS at run time
+#endif
+
+#ifndef DEFAULT_PACKED_IO
+#define DEFAULT_PACKED_IO 0 // varint-packed runs and intermediates
+#endif
+
+#ifndef RULER_SPACING
+#define RULER_SPACING 256 // power of two
+#endif
+
+#ifndef DEFAULT_REPLACEMENT_SELECTION
+#define DEFAULT_REPLACEMENT_SELECTION 0
+#endif
+
+#ifndef DEFAULT_CHECKPOINT
+#define DEFAULT_CHECKPOINT 0 // 1: record finished levels, as --checkpoint (or EXT_CHECKPOINT=1) does at run time
+#endif
+
+#ifndef DEFAULT_LOCAL_MINIMA_CONTRACTION
+#define DEFAULT_LOCAL_MINIMA_CONTRACTION 1 // 0: independent coin flips
 #endif
 
 #ifndef DEFAULT_BLOCKS_NUMBER
@@ -27,10 +95,15 @@
 #endif
 
 #define DEFAULT_INPUT_PATTERN ("input.bin")
+// input.bin: uint32 size below both marks + uint32 <i, n(i)> pairs, or this mark + uint64 size + uint64 pairs
+#define WIDE_INPUT_MARK 0xffffffffu
+// or this mark + uint64 size + uint64 <i, n(i), list> of many lists, n(i) = 0 ends a list;
+// output.bin is then uint64 <list, i> pairs: lists by ascending list id, each from its head
+#define FOREST_INPUT_MARK 0xfffffffeu
 #define DEFAULT_OUTPUT ("output.bin")
 
 #if _LOCAL_TEST
-#define RUN_NAME_PATTERN "/tmp/run.%d.bin"
+#define DEFAULT_SPILL_DIRS "/tmp"
 #define SEVEN_NAME_PATTERN "/tmp/seven.%d.bin"
 #define FIVE_NAME_PATTERN "/tmp/five.%d.bin"
 #define RANKED_NAME_PATTERN "/tmp/ranked.%d.bin"
@@ -39,8 +112,18 @@
 #define JOIN_LEFT_NAME "/tmp/join.left.tmp.bin"
 #define JOIN_RIGHT_NAME "/tmp/join.right.tmp.bin"
 #define JOIN_RESULT_NAME "/tmp/join.result.tmp.bin"
+#define EXCHANGE_NAME_PATTERN "/tmp/exchange.%s.%zu.%zu.bin"
+#define REPORT_NAME "/tmp/report.json"
+#define CHECKPOINT_NAME "/tmp/checkpoint.txt"
+
+#define FOREST_NODES_NAME "/tmp/forest.nodes.bin"
+#define FOREST_SUCCESSORS_NAME "/tmp/forest.successors.bin"
+#define FOREST_HEADS_NAME "/tmp/forest.heads.bin"
+#define FOREST_TAILS_NAME "/tmp/forest.tails.bin"
+#define FOREST_LINKS_NAME "/tmp/forest.links.bin"
+#define FOREST_LIST_NAME "/tmp/forest.list.bin"
 #else
-#define RUN_NAME_PATTERN "run.%d.bin"
+#define DEFAULT_SPILL_DIRS "."
 #define SEVEN_NAME_PATTERN "seven.%d.bin"
 #define FIVE_NAME_PATTERN "five.%d.bin"
 #define RANKED_NAME_PATTERN "ranked.%d.bin"
@@ -49,10 +132,26 @@
 #define JOIN_LEFT_NAME "join.left.tmp.bin"
 #define JOIN_RIGHT_NAME "join.right.tmp.bin"
 #define JOIN_RESULT_NAME "join.result.tmp.bin"
+#define EXCHANGE_NAME_PATTERN "exchange.%s.%zu.%zu.bin"
+#define REPORT_NAME "report.json"
+#define CHECKPOINT_NAME "checkpoint.txt"
+
+#define FOREST_NODES_NAME "forest.nodes.bin"
+#define FOREST_SUCCESSORS_NAME "forest.successors.bin"
+#define FOREST_HEADS_NAME "forest.heads.bin"
+#define FOREST_TAILS_NAME "forest.tails.bin"
+#define FOREST_LINKS_NAME "forest.links.bin"
+#define FOREST_LIST_NAME "forest.list.bin"
 #endif
 
 #ifndef MAX_PATH
-#define MAX_PATH 20
+#define MAX_PATH 64
+#endif
+
+#define SPILL_NAME_PATTERN "%s/spill.%zu.bin"
+
+#ifndef DEFAULT_SPILL_GROWTH
+#define DEFAULT_SPILL_GROWTH (16 << 20) // spill files are preallocated in steps of this many bytes
 #endif
 
 #ifndef __compar_fn_t
@@ -61,714 +160,4562 @@ typedef int(*comparator_func_t)(const void *, const void *);
 
 #endif
 
-struct run_t {
-    FILE *file;
-    int id;
+typedef uint64_t elements_size_t; // record count in file headers
 
-    explicit run_t(int id) : file(nullptr), id(id) {}
+// header bit of files stored with record_codec_t, readers pick the format up from it
+static const elements_size_t PACKED_FILE = elements_size_t(1) << 63;
 
-    const char *get_name() {
-        static char name[MAX_PATH]{};
+// process-wide counters behind the run report; io_wait_ns is time spent blocked on file io
+struct io_stats_t {
+    std::atomic<uint64_t> bytes_read{0};
+    std::atomic<uint64_t> bytes_written{0};
+    std::atomic<uint64_t> io_wait_ns{0};
+    std::atomic<uint64_t> runs{0};
+    std::atomic<uint64_t> merge_passes{0};
+    std::atomic<uint64_t> records_joined{0};
+    std::atomic<uint64_t> records_mapped{0};
 
-        sprintf(name, RUN_NAME_PATTERN, id);
-        return name;
+    static io_stats_t &instance() {
+        static io_stats_t stats;
+        return stats;
+    }
+
+    static uint64_t now_ns() {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
     }
 };
 
-typedef uint32_t elements_size_t;
+// fread and fwrite that feed io_stats_t; blocking ones count their duration as io wait
+static size_t counted_fread(void *buf, size_t size, size_t cnt, FILE *file, bool blocking = true) {
+    uint64_t start = blocking ? io_stats_t::now_ns() : 0;
+    size_t done = fread(buf, size, cnt, file);
 
-struct run_pool_t {
+    io_stats_t::instance().bytes_read += done * size;
+    if (blocking) {
+        io_stats_t::instance().io_wait_ns += io_stats_t::now_ns() - start;
+    }
+    return done;
+}
 
-    std::queue<run_t *> runs;
+static size_t counted_fwrite(const void *buf, size_t size, size_t cnt, FILE *file, bool blocking = true) {
+    uint64_t start = blocking ? io_stats_t::now_ns() : 0;
+    size_t done = fwrite(buf, size, cnt, file);
 
-    run_pool_t() : runs() {}
+    io_stats_t::instance().bytes_written += done * size;
+    if (blocking) {
+        io_stats_t::instance().io_wait_ns += io_stats_t::now_ns() - start;
+    }
+    return done;
+}
 
-    static run_pool_t *of_size(size_t size) {
-        int id_counter = 0;
-        auto *pool = new run_pool_t();
-        const elements_size_t zero = 0;
+// --shards=N worker processes share the contraction and restore levels of a ranking. Worker k owns the node ids
+// of the k-th of N equal slices of the input id range and keeps the records keyed by them; records keyed by
+// another slice are exchanged through one file per pair of workers, the workers meet at process-shared
+// barriers in between. The coordinator (the parent) runs the base case and all of main around the levels.
+// Workers are forked at start-up, before any thread exists, and die with the coordinator. Sharded runs keep no
+// checkpoint of their levels
+struct shards_t {
+    static const size_t max_shards = 64;
+    static const size_t max_levels = 256;
 
-        for (size_t i = 0; i < size; i++) {
-            auto run = new run_t(id_counter++);
-            const char *name = run->get_name();
+    // what the coordinator asks the workers to rank, see rank_nodes
+    struct job_t {
+        char input[MAX_PATH + 256];
+        long input_offset;
+        elements_size_t input_size;
+        uint32_t id_bits;
+        uint32_t input_id_bits;
+        elements_size_t base_case_size; // contraction stops below this many records
+        bool quit;
+    };
 
-            run->file = fopen(name, "wb+");
-            setvbuf(run->file, nullptr, _IONBF, 0);
-            fwrite(&zero, sizeof zero, 1, run->file);
-            pool->put(run);
-        }
-        return pool;
+    // a barrier whose waiters notice a failed worker, pthread_barrier_t waits forever
+    struct barrier_t {
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        size_t waiting;
+        uint64_t generation;
+    };
+
+    // mapped shared by the coordinator and the workers
+    struct shared_t {
+        barrier_t workers; // the N workers
+        barrier_t all; // the workers and the coordinator
+        std::atomic<bool> failed;
+        job_t job;
+        uint64_t values[max_shards]; // contributions to a reduction
+        uint64_t io[max_shards][3]; // bytes read, written and io wait of each worker's last job
+        uint32_t levels;
+        elements_size_t level_sizes[max_levels][2];
+    };
+
+    size_t count = 1;
+    size_t index = 0; // of a worker
+    bool worker = false;
+    shared_t *shared = nullptr;
+    std::vector<pid_t> pids;
+    uint64_t min_id = 0; // worker k owns ids [min_id + k * width, min_id + (k + 1) * width) of [min_id, max_id]
+    uint64_t max_id = 0;
+    uint64_t width = 1;
+    uint64_t sent_io[3] = {0, 0, 0};
+
+    static shards_t &instance() {
+        static shards_t shards;
+        return shards;
     }
 
-    run_t *get() {
-        return get(nullptr, 0, 0);
+    bool coordinating() const {
+        return (count > 1) && !worker;
     }
 
-    run_t *get(void *buf, size_t element_size, size_t elements_cnt) {
-        auto run = runs.front();
-        run->file = fopen(run->get_name(), "rb+");
-        size_t buf_size = element_size * elements_cnt;
-        setvbuf(run->file, (char *) buf, buf_size ? _IOFBF : _IONBF, buf_size);
-        runs.pop();
-        return run;
+    // forks the workers; returns true in a worker, which serves jobs from then on
+    bool start(size_t shards) {
+        count = std::min(shards, size_t(max_shards));
+        if (count <= 1) {
+            return false;
+        }
+        void *mem = mmap(nullptr, sizeof(shared_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            fprintf(stderr, "no shared memory for %zu shards, ranking in one process\n", count);
+            count = 1;
+            return false;
+        }
+        shared = new(mem) shared_t();
+        init(shared->workers);
+        init(shared->all);
+
+        pid_t parent = getpid();
+        for (size_t k = 0; k < count; k++) {
+            pid_t pid = fork();
+
+            if (pid == 0) {
+                prctl(PR_SET_PDEATHSIG, SIGKILL);
+                if (getppid() != parent) {
+                    _exit(EXIT_FAILURE);
+                }
+                worker = true;
+                index = k;
+                pids.clear();
+                return true;
+            } else if (pid < 0) {
+                fprintf(stderr, "cannot fork shard worker %zu\n", k);
+                fail();
+            }
+            pids.push_back(pid);
+        }
+        return false;
     }
 
-    void put(run_t *run) {
-        fclose(run->file);
-        runs.push(run);
+    // the workers exit once the coordinator is done
+    void stop() {
+        if (!coordinating()) {
+            return;
+        }
+        shared->job.quit = true;
+        wait_all();
+        for (pid_t pid : pids) {
+            waitpid(pid, nullptr, 0);
+        }
+        pids.clear();
     }
 
-    void release(run_t *run) {
-        fclose(run->file);
-        delete run;
+    void wait_workers() {
+        wait(shared->workers, count);
     }
 
-    size_t size() const {
-        return runs.size();
+    void wait_all() {
+        wait(shared->all, count + 1);
     }
 
-    ~run_pool_t() {
-        while (!runs.empty()) {
-            auto *run = runs.front();
-            runs.pop();
-            delete run;
+    // op over the values every worker passes, in every worker
+    template<typename op_T>
+    uint64_t reduce(uint64_t value, op_T op) {
+        shared->values[index] = value;
+        wait_workers();
+        uint64_t result = shared->values[0];
+        for (size_t k = 1; k < count; k++) {
+            result = op(result, shared->values[k]);
         }
+        wait_workers(); // values are reused by the next reduction
+        return result;
     }
-};
 
-template<typename element_T>
-int cmp_elements(const void *l, const void *r) {
-    element_T left = *(element_T *) l;
-    element_T right = *(element_T *) r;
+    uint64_t sum(uint64_t value) {
+        return reduce(value, [](uint64_t a, uint64_t b) { return a + b; });
+    }
 
-    if (left < right) {
-        return -1;
-    } else if (left > right) {
-        return 1;
-    } else {
-        return 0;
+    void partition(uint64_t lo, uint64_t hi) {
+        min_id = lo;
+        max_id = hi;
+        width = (hi - lo) / count + 1;
     }
-}
 
-template<typename element_T>
-struct merger_t {
-    element_T *ram;
-    size_t ram_size_elements;
-    run_pool_t *runs;
-    bool self_alloc;
+    size_t owner(uint64_t id) const {
+        return (id <= min_id) ? 0 : static_cast<size_t>(std::min<uint64_t>((id - min_id) / width, count - 1));
+    }
 
-    bool write_output_size = true;
+    // first and last id owned by worker k, clamped to [min_id, max_id]
+    uint64_t first_id(size_t k) const {
+        return (k * width > max_id - min_id) ? max_id : min_id + k * width;
+    }
 
-    merger_t(void *ram, size_t ram_size_bytes) :
-            ram((element_T *) ram),
-            ram_size_elements(ram_size_bytes / sizeof(element_T)),
-            runs(nullptr),
-            self_alloc(false) {}
+    uint64_t last_id(size_t k) const {
+        return ((k + 1 == count) || ((k + 1) * width > max_id - min_id)) ? max_id : min_id + (k + 1) * width - 1;
+    }
 
-    void split_into_runs(FILE *in, comparator_func_t cmp) {
-        elements_size_t size;
+    // the copy of an intermediate kept by worker k, workers share the directory
+    static std::string shard_name(const char *name, size_t k) {
+        return std::string(name) + ".shard" + std::to_string(k);
+    }
 
-        fread(&size, sizeof size, 1, in);
-        size_t runs_cnt = (size != 0) ? 1 + ((size - 1) / ram_size_elements) : 0; // ceiling
+    // name as seen by this process: a worker's own copy
+    std::string local(const char *name) const {
+        return worker ? shard_name(name, index) : std::string(name);
+    }
 
-        delete runs;
-        runs = run_pool_t::of_size(runs_cnt + 1);
+    // a file records go through from worker from to worker to under tag
+    static std::string exchange_name(const char *tag, size_t from, size_t to) {
+        char name[MAX_PATH + 256]{};
 
-        for (size_t i = 0; i < runs_cnt; i++) {
-            auto read = static_cast<elements_size_t>(((i + 1) * ram_size_elements <= size) ? ram_size_elements : (size % ram_size_elements));
+        snprintf(name, sizeof name, EXCHANGE_NAME_PATTERN, tag, from, to);
+        return name;
+    }
 
-            fread(ram, sizeof *ram, read, in);
-            qsort(ram, read, sizeof *ram, cmp);
+    // a worker reports its io of a job to the coordinator, which counts it as its own
+    void send_io() {
+        io_stats_t &stats = io_stats_t::instance();
+        uint64_t now[] = {stats.bytes_read, stats.bytes_written, stats.io_wait_ns};
 
-            run_t *run = runs->get();
-            fwrite(&read, sizeof read, 1, run->file);
-            fwrite(ram, sizeof *ram, read, run->file);
-            runs->put(run);
+        for (size_t i = 0; i < 3; i++) {
+            shared->io[index][i] = now[i] - sent_io[i];
+            sent_io[i] = now[i];
         }
     }
 
-    void merge(FILE *files[], size_t rank, FILE *result, comparator_func_t cmp) {
-        struct input {
-            FILE *file{};
-            element_T val{};
-            elements_size_t size = 0;
-            bool read = false;
-        } *inputs = new input[rank]();
-        elements_size_t result_size = 0;
+    void receive_io() {
+        io_stats_t &stats = io_stats_t::instance();
 
-        for (size_t i = 0; i < rank; i++) {
-            auto &inp = inputs[i];
-            inp.file = files[i];
-            fread(&inp.size, sizeof inp.size, 1, inp.file);
-            result_size += inp.size;
-        }
-        if (write_output_size) {
-            fwrite(&result_size, sizeof result_size, 1, result);
+        for (size_t k = 0; k < count; k++) {
+            stats.bytes_read += shared->io[k][0];
+            stats.bytes_written += shared->io[k][1];
+            stats.io_wait_ns += shared->io[k][2];
         }
+    }
 
-        while (true) {
-            input *min_elem = nullptr;
-            for (size_t i = 0; i < rank; i++) {
-                auto &inp = inputs[i];
-                if (!inp.read && !inp.size) {
-                    continue;
-                }
-                if (!inp.read) {
-                    fread(&inp.val, sizeof inp.val, 1, inp.file);
-                    inp.read = true;
-                    inp.size--;
-                }
-                if ((min_elem == nullptr) || (cmp(&inp.val, &min_elem->val) < 0)) {
-                    min_elem = &inp;
-                }
-            }
-            if (min_elem == nullptr) {
-                break;
-            }
-            fwrite(&min_elem->val, sizeof min_elem->val, 1, result);
-            min_elem->read = false;
+    [[noreturn]] void fail() const {
+        if (worker) {
+            _exit(EXIT_FAILURE);
         }
-        delete[] inputs;
+        fprintf(stderr, "shard worker failed\n");
+        for (pid_t pid : pids) {
+            kill(pid, SIGKILL);
+        }
+        exit(EXIT_FAILURE);
     }
 
-    void do_merge_sort(
-            FILE *in,
-            FILE *out,
-            comparator_func_t cmp = cmp_elements<element_T>,
-            size_t rank = DEFAULT_MERGE_RANK) {
-        split_into_runs(in, cmp);
-        size_t block_size = ram_size_elements / 2 / (rank);
-        size_t result_block_size = ram_size_elements / 2;
-        auto *result_block = ram + rank * block_size;
+private:
+    static void init(barrier_t &barrier) {
+        pthread_mutexattr_t mutex_attr;
+        pthread_condattr_t cond_attr;
 
-        assert(block_size > 0);
-        assert(result_block_size > 0);
-        assert((rank * block_size + result_block_size) <= ram_size_elements);
+        pthread_mutexattr_init(&mutex_attr);
+        pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutex_init(&barrier.mutex, &mutex_attr);
+        pthread_mutexattr_destroy(&mutex_attr);
+        pthread_condattr_init(&cond_attr);
+        pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+        pthread_cond_init(&barrier.cond, &cond_attr);
+        pthread_condattr_destroy(&cond_attr);
+    }
 
-        run_t *result = runs->get(result_block, sizeof *ram, result_block_size);
+    // a worker exits only when told to, the coordinator fails the run as soon as one is gone
+    bool lost_worker() const {
+        for (pid_t pid : pids) {
+            int status = 0;
 
-        if (runs->size() == 0) {
-            // should never happen since N > 1
-            fseek(in, 0, SEEK_SET);
-            merge(&in, 1, out, cmp);
-            return;
+            if (waitpid(pid, &status, WNOHANG) == pid) {
+                return true;
+            }
         }
-        auto files = new FILE *[rank];
-        auto **used_runs = new run_t *[rank];
-
-        auto write_output_size = this->write_output_size;
-        this->write_output_size = true;
+        return false;
+    }
 
-        while (runs->size() > 1) {
-            size_t files_cnt = 0;
-            element_T *block_start = ram;
+    // waiters look at the failed flag and the workers every 100ms
+    void wait(barrier_t &barrier, size_t parties) {
+        pthread_mutex_lock(&barrier.mutex);
+        uint64_t generation = barrier.generation;
 
-            for (; (files_cnt < rank) && (runs->size() != 0); files_cnt++, block_start += block_size) {
-                used_runs[files_cnt] = runs->get(block_start, sizeof *block_start, block_size);
-                files[files_cnt] = used_runs[files_cnt]->file;
+        if (++barrier.waiting == parties) {
+            barrier.waiting = 0;
+            barrier.generation++;
+            pthread_cond_broadcast(&barrier.cond);
+        }
+        while (barrier.generation == generation) {
+            if (shared->failed || (!worker && lost_worker())) {
+                shared->failed = true;
+                break;
             }
-
-            merge(files, files_cnt, result->file, cmp);
-            runs->put(result);
-            for (size_t i = 1; i < files_cnt; i++) {
-                runs->release(used_runs[i]);
+            timespec deadline{};
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 100 * 1000 * 1000;
+            if (deadline.tv_nsec >= 1000 * 1000 * 1000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000 * 1000 * 1000;
             }
-            result = used_runs[0];
-            freopen(result->get_name(), "rb+", result->file);
-            setvbuf(result->file, (char *) block_start, _IOFBF, result_block_size * sizeof *block_start);
+            pthread_cond_timedwait(&barrier.cond, &barrier.mutex, &deadline);
         }
-        used_runs[0] = runs->get(ram, sizeof *ram, ram_size_elements);
+        pthread_mutex_unlock(&barrier.mutex);
+        if (shared->failed) {
+            fail();
+        }
+    }
+};
+
+// a run is an extent of a spill file: bytes [offset, offset + bytes) hold its header and records
+struct run_t {
+    FILE *file;
+    size_t spill; // index of the spill file
+    uint64_t offset;
+    uint64_t bytes; // reserved while written, 0 if unbounded; used bytes afterwards
 
-        this->write_output_size = write_output_size;
-        merge(&used_runs[0]->file, 1, out, cmp);
-        runs->release(used_runs[0]);
-        runs->release(result);
+    run_t(size_t spill, uint64_t offset, uint64_t bytes) : file(nullptr), spill(spill), offset(offset), bytes(bytes) {}
 
-        delete[] used_runs;
-        delete[] files;
+    // name of the spill file the run lives in
+    const char *get_name() const;
+
+    // positions file at pos bytes from the start of the run
+    void seek(uint64_t pos) const {
+        fseek(file, static_cast<long>(offset + pos), SEEK_SET);
     }
+};
 
-    void sort(
-            const char *input_name,
-            const char *output_name,
-            comparator_func_t cmp = cmp_elements<element_T>,
-            size_t merge_rank = DEFAULT_MERGE_RANK) {
-        FILE *input = fopen(input_name, "rb");
-        FILE *output = fopen(output_name, "wb");
+// runs of every pool live as extents of one spill file per directory of EXT_SPILL_DIRS (or DEFAULT_SPILL_DIRS),
+// a ':' separated list. New runs go round-robin over the directories, so merges read all disks at once.
+// Freed extents are reused first-fit; a run of unknown size grows at the tail of a file no other run grows in.
+// Files are opened once and their handles recycled, files are preallocated in DEFAULT_SPILL_GROWTH steps
+struct spill_t {
+    struct file_t {
+        std::string name;
+        std::vector<FILE *> handles; // idle, unbuffered
+        std::map<uint64_t, uint64_t> free; // offset -> size
+        uint64_t tail = 0;
+        uint64_t reserved = 0;
+        bool growing = false;
+    };
 
-        do_merge_sort(input, output, cmp, merge_rank);
+    std::mutex mutex;
+    std::vector<file_t> files;
+    std::vector<std::string> dirs;
+    size_t next = 0;
 
-        fclose(input);
-        fclose(output);
+    static spill_t &instance() {
+        static spill_t spill;
+        return spill;
     }
 
-    ~merger_t() {
-        if (self_alloc) {
-            delete[] ram;
+    spill_t() {
+        const char *env = getenv("EXT_SPILL_DIRS");
+        std::string list = ((env != nullptr) && *env) ? env : DEFAULT_SPILL_DIRS;
+
+        for (size_t begin = 0, end; begin <= list.size(); begin = end + 1) {
+            end = std::min(list.find(':', begin), list.size());
+            if (end > begin) {
+                dirs.push_back(list.substr(begin, end - begin));
+            }
+        }
+        if (dirs.empty()) {
+            dirs.emplace_back(".");
+        }
+        for (size_t i = 0; i < dirs.size(); i++) {
+            add_file();
         }
-        delete runs;
     }
-};
 
-template<typename element_T, size_t len>
-struct tuple {
-    element_T elem[len];
+    spill_t(const spill_t &) = delete;
 
-    typedef element_T element_t;
-};
+    // extent for a run of at most bytes, 0 if its size is unknown until written
+    run_t *allocate(uint64_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t n = files.size();
 
-tuple<uint32_t, 3> &join_deuces(
-        const tuple<uint32_t, 2> &l,
-        const tuple<uint32_t, 2> &r,
-        tuple<uint32_t, 3> &res) {
-    res.elem[0] = l.elem[0];
-    res.elem[1] = l.elem[1];
-    res.elem[2] = r.elem[1];
-    return res;
-}
+        for (size_t k = 0; k < n; k++) {
+            size_t i = (next + k) % n;
+            file_t &file = files[i];
 
-template<
-        typename left_src_T,
-        typename right_src_T,
-        typename target_T
->
-struct joiner_t {
+            if (bytes != 0) {
+                for (auto &extent : file.free) {
+                    if (extent.second >= bytes) {
+                        auto run = new run_t(i, extent.first, bytes);
+                        uint64_t left = extent.second - bytes;
 
-    typedef left_src_T left_src_t;
-    typedef right_src_T right_src_t;
-    typedef target_T target_t;
-    typedef std::function<bool(const left_src_t &, const right_src_t &, target_t &)> joiner_func_t;
-    typedef std::function<bool(const left_src_t &, const right_src_t &)> joiner_predicate_t;
+                        file.free.erase(extent.first);
+                        if (left > 0) {
+                            file.free[run->offset + bytes] = left;
+                        }
+                        next = i + 1;
+                        return run;
+                    }
+                }
+            }
+            if (!file.growing) {
+                next = i + 1;
+                return append(i, bytes);
+            }
+        }
+        // every file has a run growing at its tail, a new one takes the run
+        add_file();
+        next = 0;
+        return append(files.size() - 1, bytes);
+    }
 
-    char *ram;
-    size_t ram_size_bytes;
-    bool self_alloc;
+    FILE *open(run_t *run) {
+        std::lock_guard<std::mutex> lock(mutex);
+        file_t &file = files[run->spill];
+        FILE *handle;
 
-    joiner_t(char *ram, size_t ram_size_bytes) :
-            ram(ram),
-            ram_size_bytes(ram_size_bytes),
-            self_alloc(false) {}
+        if (file.handles.empty()) {
+            handle = fopen(file.name.c_str(), "rb+");
+            setvbuf(handle, nullptr, _IONBF, 0);
+        } else {
+            handle = file.handles.back();
+            file.handles.pop_back();
+        }
+        run->file = handle;
+        run->seek(0);
+        return handle;
+    }
 
-    void join(
-            FILE *left,
-            FILE *right,
-            FILE *result,
-            joiner_func_t joiner_func) {
-        elements_size_t left_size;
-        elements_size_t right_size;
-        fread(&left_size, sizeof left_size, 1, left);
-        fread(&right_size, sizeof right_size, 1, right);
-        fwrite(&left_size, sizeof left_size, 1, result);
+    void close(run_t *run) {
+        std::lock_guard<std::mutex> lock(mutex);
 
-        for (elements_size_t i = 0; i < left_size; i++) {
-            left_src_t l{};
-            right_src_t r{};
-            target_t res{};
+        files[run->spill].handles.push_back(run->file);
+        run->file = nullptr;
+    }
 
-            fread(&l, sizeof l, 1, left);
-            fread(&r, sizeof r, 1, right);
-            joiner_func(l, r, res);
-            fwrite(&res, sizeof res, 1, result);
+    // a written run keeps only the bytes up to its file position, the rest of its extent is freed
+    void trim(run_t *run) {
+        std::lock_guard<std::mutex> lock(mutex);
+        file_t &file = files[run->spill];
+        uint64_t used = static_cast<uint64_t>(ftell(run->file)) - run->offset;
+
+        if (run->bytes == 0) {
+            file.tail = run->offset + used;
+            file.growing = false;
+        } else if (used < run->bytes) {
+            release(file, run->offset + used, run->bytes - used);
         }
+        run->bytes = used;
     }
 
-    void left_join(
-            FILE *left,
-            FILE *right,
-            FILE *result,
-            joiner_func_t joiner_func
-    ) {
-        elements_size_t left_size;
-        elements_size_t right_size;
-        fread(&left_size, sizeof left_size, 1, left);
-        fread(&right_size, sizeof right_size, 1, right);
-        fwrite(&left_size, sizeof left_size, 1, result);
-        bool right_consumed = true;
+    void free(run_t *run) {
+        std::lock_guard<std::mutex> lock(mutex);
 
-        left_src_t  l{};
-        right_src_t r{};
-        target_t res{};
-        for (elements_size_t i = 0; i < left_size; i++) {
-            if (right_consumed) {
-                fread(&r, sizeof r, 1, right);
+        if (run->bytes != 0) {
+            release(files[run->spill], run->offset, run->bytes);
+        }
+    }
+
+    ~spill_t() {
+        for (auto &file : files) {
+            for (FILE *handle : file.handles) {
+                fclose(handle);
             }
-            fread(&l, sizeof l, 1, left);
-            right_consumed = joiner_func(l, r, res);
-            fwrite(&res, sizeof res, 1, result);
+            remove(file.name.c_str());
         }
     }
 
-    void join(
-            const char *left_name,
-            const char *right_name,
-            const char *result_name,
-            joiner_func_t joiner_func) {
-        FILE *left = fopen(left_name, "rb");
-        FILE *right = fopen(right_name, "rb");
-        FILE *result = fopen(result_name, "wb");
+private:
+    void add_file() {
+        char name[MAX_PATH + 256]{};
+        size_t i = files.size();
 
-        size_t left_block_size = ram_size_bytes * sizeof(left_src_t)
-                / (sizeof(left_src_t) + sizeof(right_src_t) + sizeof(target_t));
-        size_t right_block_size = ram_size_bytes * sizeof(right_src_t)
-                / (sizeof(left_src_t) + sizeof(right_src_t) + sizeof(target_t));
-        size_t result_block_size = ram_size_bytes - left_block_size - right_block_size;
+        snprintf(name, sizeof name, SPILL_NAME_PATTERN, dirs[i % dirs.size()].c_str(), i);
+        files.emplace_back();
+        files.back().name = shards_t::instance().local(name);
 
-        assert(left_block_size > 0);
-        assert(right_block_size > 0);
-        assert(result_block_size > 0);
-        assert((left_block_size + right_block_size + result_block_size) <= ram_size_bytes);
+        FILE *handle = fopen(files.back().name.c_str(), "wb+");
+        setvbuf(handle, nullptr, _IONBF, 0);
+        files.back().handles.push_back(handle);
+    }
 
-        setvbuf(left, ram, _IOFBF, left_block_size);
-        setvbuf(right, ram + left_block_size, _IOFBF, right_block_size);
-        setvbuf(result, ram + left_block_size + right_block_size, _IOFBF, result_block_size);
+    run_t *append(size_t i, uint64_t bytes) {
+        file_t &file = files[i];
+        auto run = new run_t(i, file.tail, bytes);
 
-        left_join(left, right, result, joiner_func);
+        if (bytes == 0) {
+            file.growing = true;
+        } else {
+            file.tail += bytes;
+        }
+        // preallocate ahead of the tail, a growing run may need up to a step more
+        uint64_t needed = std::max(file.tail + bytes, run->offset + DEFAULT_SPILL_GROWTH);
+        if (needed > file.reserved) {
+            uint64_t reserve = (needed + DEFAULT_SPILL_GROWTH - 1) / DEFAULT_SPILL_GROWTH * DEFAULT_SPILL_GROWTH;
+
+            if (!file.handles.empty()
+                && posix_fallocate(fileno(file.handles.back()), static_cast<off_t>(file.reserved),
+                                   static_cast<off_t>(reserve - file.reserved)) == 0) {
+                file.reserved = reserve;
+            }
+        }
+        return run;
+    }
+
+    // frees [offset, offset + size), merged with free neighbours; an extent ending at the tail shortens it
+    static void release(file_t &file, uint64_t offset, uint64_t size) {
+        auto after = file.free.lower_bound(offset);
+
+        if ((after != file.free.end()) && (after->first == offset + size)) {
+            size += after->second;
+            after = file.free.erase(after);
+        }
+        if (after != file.free.begin()) {
+            auto before = std::prev(after);
+            if (before->first + before->second == offset) {
+                offset = before->first;
+                size += before->second;
+                file.free.erase(before);
+            }
+        }
+        if (!file.growing && (offset + size == file.tail)) {
+            file.tail = offset;
+        } else {
+            file.free[offset] = size;
+        }
+    }
+};
+
+const char *run_t::get_name() const {
+    return spill_t::instance().files[spill].name.c_str();
+}
+
+struct run_pool_t {
+
+    std::queue<run_t *> runs;
+
+    run_pool_t() : runs() {}
+
+    // new run of at most bytes (0: unknown), open for writing at its start
+    run_t *create(uint64_t bytes = 0) {
+        auto run = spill_t::instance().allocate(bytes);
+
+        spill_t::instance().open(run);
+        io_stats_t::instance().runs++;
+        return run;
+    }
+
+    // oldest run, open for reading at its start
+    run_t *get() {
+        auto run = runs.front();
+
+        runs.pop();
+        spill_t::instance().open(run);
+        return run;
+    }
+
+    // queues a run just written, its file position marks its end
+    void put(run_t *run) {
+        spill_t::instance().trim(run);
+        spill_t::instance().close(run);
+        runs.push(run);
+    }
+
+    static void release(run_t *run) {
+        spill_t::instance().close(run);
+        spill_t::instance().free(run);
+        delete run;
+    }
+
+    size_t size() const {
+        return runs.size();
+    }
+
+    ~run_pool_t() {
+        while (!runs.empty()) {
+            auto *run = runs.front();
+            runs.pop();
+            spill_t::instance().free(run);
+            delete run;
+        }
+    }
+};
+
+struct io_request_t {
+    FILE *file;
+    void *buf;
+    size_t element_size;
+    size_t cnt;
+    bool write;
+    size_t done_cnt;
+    bool done;
+};
+
+// background thread serving fread/fwrite requests in submission order
+struct io_engine_t {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::queue<io_request_t *> requests;
+    bool stopping;
+    std::thread worker;
+
+    io_engine_t() : stopping(false), worker([this]() { serve(); }) {}
+
+    static io_engine_t &instance() {
+        static io_engine_t engine;
+        return engine;
+    }
+
+    void submit(io_request_t *req) {
+        std::lock_guard<std::mutex> lock(mutex);
+        req->done = false;
+        requests.push(req);
+        cv.notify_all();
+    }
+
+    void wait(io_request_t *req) {
+        uint64_t start = io_stats_t::now_ns();
+        std::unique_lock<std::mutex> lock(mutex);
+
+        cv.wait(lock, [req]() { return req->done; });
+        io_stats_t::instance().io_wait_ns += io_stats_t::now_ns() - start;
+    }
+
+    ~io_engine_t() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+private:
+    void serve() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true) {
+            cv.wait(lock, [this]() { return stopping || !requests.empty(); });
+            if (requests.empty()) {
+                return;
+            }
+            auto *req = requests.front();
+            requests.pop();
+
+            lock.unlock();
+            req->done_cnt = req->write
+                    ? counted_fwrite(req->buf, req->element_size, req->cnt, req->file, false)
+                    : counted_fread(req->buf, req->element_size, req->cnt, req->file, false);
+            lock.lock();
+
+            req->done = true;
+            cv.notify_all();
+        }
+    }
+};
+
+template<typename element_T, size_t len>
+struct tuple;
+
+// records seen as arrays of same-typed columns by the record codec
+template<typename element_T>
+struct columns_t {
+    typedef element_T value_t;
+    static const size_t count = 1;
+
+    static value_t *of(element_T &val) {
+        return &val;
+    }
+
+    static const value_t *of(const element_T &val) {
+        return &val;
+    }
+};
+
+template<typename value_T, size_t len>
+struct columns_t<tuple<value_T, len>> {
+    typedef value_T value_t;
+    static const size_t count = len;
+
+    static value_t *of(tuple<value_T, len> &val) {
+        return val.elem;
+    }
+
+    static const value_t *of(const tuple<value_T, len> &val) {
+        return val.elem;
+    }
+};
+
+// packed files are a sequence of chunks: uint32 record count, a mode byte per column, then the
+// records row by row. Each column is stored raw, as LEB128 varints, or as varint deltas when it
+// never decreases (the key of a sorted run), whichever is smallest; flags and small weights
+// take a byte, so a chunk is never larger than its raw records plus the header
+template<typename element_T>
+struct record_codec_t {
+    typedef columns_t<element_T> columns;
+    typedef typename columns::value_t value_t;
+
+    enum : uint8_t {
+        RAW, VARINT, DELTA
+    };
+
+    static const size_t cols = columns::count;
+    static const size_t header_size = sizeof(uint32_t) + cols;
+    static const size_t max_record_size = cols * ((sizeof(value_t) * 8 + 6) / 7); // <= 2 * raw
+
+    struct chunk_t {
+        uint8_t modes[cols];
+        value_t prev[cols];
+        uint32_t left;
+    };
+
+    static size_t varint_size(value_t v) {
+        size_t size = 1;
+
+        for (; v >= 0x80; v >>= 7) {
+            size++;
+        }
+        return size;
+    }
+
+    static uint8_t *put_varint(uint8_t *out, value_t v) {
+        for (; v >= 0x80; v >>= 7) {
+            *out++ = static_cast<uint8_t>(v | 0x80);
+        }
+        *out++ = static_cast<uint8_t>(v);
+        return out;
+    }
+
+    static const uint8_t *get_varint(const uint8_t *in, value_t &v) {
+        v = 0;
+        for (size_t shift = 0;; shift += 7) {
+            uint8_t byte = *in++;
+            v |= value_t(byte & 0x7f) << shift;
+            if (byte < 0x80) {
+                return in;
+            }
+        }
+    }
+
+    static void pick_modes(const element_T *data, size_t cnt, uint8_t *modes) {
+        for (size_t c = 0; c < cols; c++) {
+            size_t raw = cnt * sizeof(value_t);
+            size_t varint = 0;
+            size_t delta = 0;
+            bool ordered = true;
+            value_t prev = 0;
+
+            for (size_t i = 0; i < cnt; i++) {
+                value_t v = columns::of(data[i])[c];
+
+                varint += varint_size(v);
+                ordered = ordered && (v >= prev);
+                delta += ordered ? varint_size(v - prev) : 0;
+                prev = v;
+            }
+            if (ordered && (delta <= varint) && (delta < raw)) {
+                modes[c] = DELTA;
+            } else {
+                modes[c] = (varint < raw) ? VARINT : RAW;
+            }
+        }
+    }
+
+    static uint8_t *put_record(uint8_t *out, const element_T &val, const uint8_t *modes, value_t *prev) {
+        const value_t *v = columns::of(val);
+
+        for (size_t c = 0; c < cols; c++) {
+            switch (modes[c]) {
+                case RAW:
+                    memcpy(out, v + c, sizeof(value_t));
+                    out += sizeof(value_t);
+                    break;
+                case VARINT:
+                    out = put_varint(out, v[c]);
+                    break;
+                default:
+                    out = put_varint(out, v[c] - prev[c]);
+                    prev[c] = v[c];
+            }
+        }
+        return out;
+    }
+
+    static const uint8_t *get_record(const uint8_t *in, element_T &val, chunk_t &chunk) {
+        value_t *v = columns::of(val);
+
+        for (size_t c = 0; c < cols; c++) {
+            switch (chunk.modes[c]) {
+                case RAW:
+                    memcpy(v + c, in, sizeof(value_t));
+                    in += sizeof(value_t);
+                    break;
+                case VARINT:
+                    in = get_varint(in, v[c]);
+                    break;
+                default:
+                    in = get_varint(in, v[c]);
+                    v[c] += chunk.prev[c];
+                    chunk.prev[c] = v[c];
+            }
+        }
+        chunk.left--;
+        return in;
+    }
+
+    static size_t put_header(uint8_t *out, size_t cnt, const uint8_t *modes) {
+        auto records = static_cast<uint32_t>(cnt);
+
+        memcpy(out, &records, sizeof records);
+        memcpy(out + sizeof records, modes, cols);
+        return header_size;
+    }
+
+    static const uint8_t *get_header(const uint8_t *in, chunk_t &chunk) {
+        memcpy(&chunk.left, in, sizeof chunk.left);
+        memcpy(chunk.modes, in + sizeof chunk.left, cols);
+        std::fill(chunk.prev, chunk.prev + cols, value_t(0));
+        return in + header_size;
+    }
+
+    // packs cnt records into out (which may be data itself) and hands every finished chunk to
+    // emit(header, header_size, bytes, bytes_size); a chunk is cut early whenever its bytes would
+    // outgrow out or, packing in place, catch up with records not packed yet
+    template<typename emit_T>
+    static void pack(const element_T *data, size_t cnt, uint8_t *out, size_t out_size, emit_T emit) {
+        bool in_place = (out == (const uint8_t *) data);
+        uint8_t modes[cols];
+        value_t prev[cols]{};
+        uint8_t header[header_size];
+        uint8_t record[max_record_size];
+        size_t begin = 0;
+        size_t pos = 0;
+
+        pick_modes(data, cnt, modes);
+        for (size_t i = 0; i < cnt; i++) {
+            size_t limit = in_place ? (i + 1) * sizeof(element_T) : out_size;
+            size_t len = put_record(record, data[i], modes, prev) - record;
+
+            if (pos + len > limit) {
+                if (i > begin) {
+                    emit(header, put_header(header, i - begin, modes), out, pos);
+                }
+                begin = i;
+                pos = 0;
+                std::fill(prev, prev + cols, value_t(0));
+                len = put_record(record, data[i], modes, prev) - record;
+                if (len > limit) { // only a record at the very start can be too long
+                    emit(header, put_header(header, 1, modes), record, len);
+                    begin = i + 1;
+                    std::fill(prev, prev + cols, value_t(0));
+                    continue;
+                }
+            }
+            memcpy(out + pos, record, len);
+            pos += len;
+        }
+        if (cnt > begin) {
+            emit(header, put_header(header, cnt - begin, modes), out, pos);
+        }
+    }
+
+    static void write(FILE *file, element_T *data, size_t cnt) {
+        pack(data, cnt, (uint8_t *) data, cnt * sizeof *data,
+             [file](const uint8_t *header, size_t header_len, const uint8_t *bytes, size_t len) {
+                 counted_fwrite(header, 1, header_len, file);
+                 counted_fwrite(bytes, 1, len, file);
+             });
+    }
+};
+
+// with async io buf is split in two halves: one is consumed while the other is read ahead.
+// A mapped reader leaves buf unused and hands out records straight from an mmap of the file,
+// keeping at most a window of capacity records resident; the file is mapped on the first refill,
+// so a reader may still be copied before it is read from. A packed reader splits buf into records
+// and a window of file bytes they are decoded from
+template<typename element_T>
+struct block_reader_t {
+    typedef record_codec_t<element_T> codec_t;
+
+    FILE *file;
+    element_T *buf;
+    size_t capacity; // per half
+    size_t pos;
+    size_t filled;
+    elements_size_t remaining; // records left in file, not yet requested
+    bool async;
+    size_t active;
+    io_request_t pending;
+    bool prefetching;
+    bool mapped;
+    char *map_base;
+    size_t map_size;
+    size_t released; // bytes at the start of the mapping already dropped
+    const element_T *window;
+    bool packed;
+    uint8_t *bytes;
+    size_t bytes_capacity;
+    size_t bytes_pos;
+    size_t bytes_end;
+    typename codec_t::chunk_t chunk;
+
+    block_reader_t() : block_reader_t(nullptr, nullptr, 0, 0) {}
+
+    block_reader_t(
+            FILE *file,
+            element_T *buf,
+            size_t capacity,
+            elements_size_t size,
+            bool mapped = false,
+            bool packed = false) :
+            file(file),
+            buf(buf),
+            capacity(capacity),
+            pos(0),
+            filled(0),
+            remaining(size),
+            async(DEFAULT_ASYNC_IO && !mapped && !packed && (capacity > 1)),
+            active(0),
+            pending(),
+            prefetching(false),
+            mapped(mapped && !packed && (size > 0)),
+            map_base(nullptr),
+            map_size(0),
+            released(0),
+            window(nullptr),
+            packed(packed),
+            bytes(nullptr),
+            bytes_capacity(0),
+            bytes_pos(0),
+            bytes_end(0),
+            chunk() {
+        if (async) {
+            this->capacity /= 2;
+        }
+        if (packed) {
+            size_t total = capacity * sizeof(element_T);
+
+            bytes_capacity = std::max(total / 2, codec_t::header_size + codec_t::max_record_size);
+            this->capacity = (total - std::min(total, bytes_capacity)) / sizeof(element_T);
+            bytes = (uint8_t *) (buf + this->capacity);
+            assert(buf == nullptr || this->capacity > 0);
+        }
+    }
+
+    bool empty() const {
+        return (pos == filled) && (remaining == 0) && !prefetching;
+    }
+
+    // hands out the rest of the block, refilling it first if needed; 0 when empty
+    size_t fetch(const element_T *&data) {
+        if (pos == filled) {
+            refill();
+        }
+        data = block() + pos;
+        size_t cnt = filled - pos;
+        pos = filled;
+        return cnt;
+    }
+
+    const element_T &next() {
+        if (pos == filled) {
+            refill();
+        }
+        return block()[pos++];
+    }
+
+    ~block_reader_t() {
+        if (prefetching) {
+            io_engine_t::instance().wait(&pending);
+        }
+        if (map_base != nullptr) {
+            munmap(map_base, map_size);
+        }
+    }
+
+private:
+    const element_T *block() {
+        return mapped ? window : buf + active * capacity;
+    }
+
+    void refill() {
+        pos = 0;
+        if (mapped) {
+            slide_window();
+            return;
+        }
+        if (packed) {
+            unpack();
+            return;
+        }
+        if (!async) {
+            auto cnt = static_cast<elements_size_t>(std::min<size_t>(capacity, remaining));
+
+            filled = counted_fread(buf, sizeof *buf, cnt, file);
+            remaining -= cnt;
+            return;
+        }
+        if (!prefetching) {
+            prefetch();
+        }
+        if (!prefetching) {
+            filled = 0;
+            return;
+        }
+        io_engine_t::instance().wait(&pending);
+        prefetching = false;
+        active ^= 1;
+        filled = pending.done_cnt;
+        prefetch();
+    }
+
+    // keeps at least cnt undecoded bytes in the window unless the file ends first
+    void want_bytes(size_t cnt) {
+        if (bytes_end - bytes_pos >= cnt) {
+            return;
+        }
+        memmove(bytes, bytes + bytes_pos, bytes_end - bytes_pos);
+        bytes_end -= bytes_pos;
+        bytes_pos = 0;
+        bytes_end += counted_fread(bytes + bytes_end, 1, bytes_capacity - bytes_end, file);
+    }
+
+    void unpack() {
+        filled = static_cast<size_t>(std::min<elements_size_t>(capacity, remaining));
+        remaining -= filled;
+        for (size_t i = 0; i < filled; i++) {
+            if (chunk.left == 0) {
+                want_bytes(codec_t::header_size);
+                bytes_pos = codec_t::get_header(bytes + bytes_pos, chunk) - bytes;
+            }
+            want_bytes(codec_t::max_record_size);
+            bytes_pos = codec_t::get_record(bytes + bytes_pos, buf[i], chunk) - bytes;
+        }
+    }
+
+    // drops the consumed window from memory and exposes the next one
+    void slide_window() {
+        static const auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+
+        if (map_base == nullptr) {
+            auto offset = static_cast<size_t>(ftell(file));
+            size_t skip = offset % page;
+
+            map_size = skip + remaining * sizeof(element_T);
+            void *addr = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fileno(file), offset - skip);
+            if (addr == MAP_FAILED) {
+                mapped = false; // fall back to plain reads into buf
+                map_size = 0;
+                refill();
+                return;
+            }
+            map_base = (char *) addr;
+            madvise(map_base, map_size, MADV_SEQUENTIAL);
+            window = (const element_T *) (map_base + skip);
+            filled = 0;
+        } else {
+            auto *consumed_end = (const char *) (window + filled);
+            size_t release = (consumed_end - map_base) / page * page;
+
+            madvise(map_base + released, release - released, MADV_DONTNEED);
+            released = release;
+            window += filled;
+        }
+        filled = static_cast<size_t>(std::min<elements_size_t>(capacity, remaining));
+        remaining -= filled;
+        io_stats_t::instance().bytes_read += filled * sizeof(element_T);
+    }
+
+    void prefetch() {
+        if (remaining == 0) {
+            return;
+        }
+        auto cnt = static_cast<elements_size_t>(std::min<size_t>(capacity, remaining));
+
+        remaining -= cnt;
+        pending = io_request_t{file, buf + (active ^ 1) * capacity, sizeof *buf, cnt, false, 0, false};
+        io_engine_t::instance().submit(&pending);
+        prefetching = true;
+    }
+};
+
+// with async io buf is split in two halves: one is filled while the other is written behind;
+// a packed writer encodes the whole of buf in place and writes it synchronously
+template<typename element_T>
+struct block_writer_t {
+    FILE *file;
+    element_T *buf;
+    size_t capacity; // per half
+    size_t filled;
+    bool async;
+    size_t active;
+    io_request_t pending;
+    bool writing;
+    bool packed;
+
+    block_writer_t() : block_writer_t(nullptr, nullptr, 0) {}
+
+    block_writer_t(FILE *file, element_T *buf, size_t capacity, bool packed = false) :
+            file(file),
+            buf(buf),
+            capacity(capacity),
+            filled(0),
+            async(DEFAULT_ASYNC_IO && !packed && (capacity > 1)),
+            active(0),
+            pending(),
+            writing(false),
+            packed(packed) {
+        if (async) {
+            this->capacity /= 2;
+        }
+    }
+
+    void put(const element_T &val) {
+        if (filled == capacity) {
+            write_behind();
+        }
+        buf[active * capacity + filled++] = val;
+    }
+
+    void put(const element_T *data, size_t cnt) {
+        assert(!packed);
+        flush();
+        counted_fwrite(data, sizeof *data, cnt, file);
+    }
+
+    // blocks until everything put so far is handed to the file
+    void flush() {
+        write_behind();
+        if (writing) {
+            io_engine_t::instance().wait(&pending);
+            writing = false;
+        }
+    }
+
+    ~block_writer_t() {
+        if (writing) {
+            io_engine_t::instance().wait(&pending);
+        }
+    }
+
+private:
+    void write_behind() {
+        element_T *block = buf + active * capacity;
+
+        if (packed) {
+            record_codec_t<element_T>::write(file, block, filled);
+            filled = 0;
+            return;
+        }
+        if (!async) {
+            counted_fwrite(block, sizeof *buf, filled, file);
+            filled = 0;
+            return;
+        }
+        if (writing) {
+            io_engine_t::instance().wait(&pending); // the other half is free again
+        }
+        if (filled == 0) {
+            writing = false;
+            return;
+        }
+        pending = io_request_t{file, block, sizeof *buf, filled, true, 0, false};
+        io_engine_t::instance().submit(&pending);
+        writing = true;
+        active ^= 1;
+        filled = 0;
+    }
+};
+
+// pull-based record stream: fills val and returns true, or returns false once exhausted
+template<typename element_T>
+using source_t = std::function<bool(element_T &)>;
+
+struct file_closer_t {
+    FILE *file;
+
+    ~file_closer_t() {
+        if (file != nullptr) {
+            fclose(file);
+        }
+    }
+};
+
+// streams size records that start at offset in name through a slice of ram
+template<typename element_T>
+source_t<element_T> file_source(
+        const char *name,
+        long offset,
+        elements_size_t size,
+        void *ram,
+        size_t ram_size,
+        bool mapped = DEFAULT_MAPPED_IO,
+        bool packed = false) {
+    struct state_t {
+        file_closer_t file; // closed only after the reader is done with it
+        block_reader_t<element_T> reader;
+    };
+    auto state = std::make_shared<state_t>();
+    FILE *file = fopen(name, "rb");
+
+    setvbuf(file, nullptr, _IONBF, 0);
+    fseek(file, offset, SEEK_SET);
+    state->file.file = file;
+    state->reader = block_reader_t<element_T>(
+            file, (element_T *) ram, ram_size / sizeof(element_T), size, mapped, packed);
+
+    return [state](element_T &val) {
+        if (state->reader.empty()) {
+            return false;
+        }
+        val = state->reader.next();
+        return true;
+    };
+}
+
+// streams a file written by the operators (size header + records) through a slice of ram
+template<typename element_T>
+source_t<element_T> file_source(const char *name, void *ram, size_t ram_size, bool mapped = DEFAULT_MAPPED_IO) {
+    FILE *file = fopen(name, "rb");
+    elements_size_t size = 0;
+
+    fread(&size, sizeof size, 1, file);
+    fclose(file);
+    return file_source<element_T>(
+            name, sizeof size, size & ~PACKED_FILE, ram, ram_size, mapped, (size & PACKED_FILE) != 0);
+}
+
+// passes source through while writing projection of every record to name, so only the columns later
+// stages read are stored; must be drained to complete the file
+template<typename element_T, typename stored_T, typename projection_T>
+source_t<element_T> tee(
+        source_t<element_T> source,
+        const char *name,
+        void *ram,
+        size_t ram_size,
+        projection_T projection,
+        bool packed = false) {
+    struct state_t {
+        source_t<element_T> source;
+        projection_T projection;
+        file_closer_t file;
+        block_writer_t<stored_T> writer;
+        elements_size_t size;
+        bool packed;
+        bool done;
+
+        explicit state_t(projection_T projection) : projection(projection), size(0), packed(false), done(false) {}
+    };
+    auto state = std::make_shared<state_t>(projection);
+    FILE *file = fopen(name, "wb");
+
+    setvbuf(file, nullptr, _IONBF, 0);
+    fwrite(&state->size, sizeof state->size, 1, file);
+    state->source = source;
+    state->file.file = file;
+    state->writer = block_writer_t<stored_T>(file, (stored_T *) ram, ram_size / sizeof(stored_T), packed);
+    state->packed = packed;
+
+    return [state](element_T &val) {
+        if (state->done) {
+            return false;
+        }
+        if (state->source(val)) {
+            stored_T stored{};
+
+            state->projection(val, stored);
+            state->writer.put(stored);
+            state->size++;
+            return true;
+        }
+        state->writer.flush();
+        state->size |= state->packed ? PACKED_FILE : 0;
+        fseek(state->file.file, 0, SEEK_SET);
+        fwrite(&state->size, sizeof state->size, 1, state->file.file);
+        state->done = true;
+        return false;
+    };
+}
+
+// passes source through while writing a copy of it to name; must be drained to complete the file
+template<typename element_T>
+source_t<element_T> tee(
+        source_t<element_T> source,
+        const char *name,
+        void *ram,
+        size_t ram_size,
+        bool packed = false) {
+    return tee<element_T, element_T>(
+            source, name, ram, ram_size, [](const element_T &val, element_T &stored) { stored = val; }, packed);
+}
+
+// drains source into name, returns number of records written
+template<typename element_T>
+elements_size_t write_to(
+        source_t<element_T> source,
+        const char *name,
+        void *ram,
+        size_t ram_size,
+        bool write_size = true,
+        bool packed = false) {
+    FILE *file = fopen(name, "wb");
+    elements_size_t size = 0;
+    element_T val{};
+
+    setvbuf(file, nullptr, _IONBF, 0);
+    if (write_size) {
+        fwrite(&size, sizeof size, 1, file);
+    }
+    {
+        block_writer_t<element_T> writer(file, (element_T *) ram, ram_size / sizeof(element_T), packed);
+        while (source(val)) {
+            writer.put(val);
+            size++;
+        }
+        writer.flush();
+    }
+    if (write_size) {
+        elements_size_t header = size | (packed ? PACKED_FILE : 0);
+        fseek(file, 0, SEEK_SET);
+        fwrite(&header, sizeof header, 1, file);
+    }
+    fclose(file);
+    return size;
+}
+
+// records of files name(0) .. name(count - 1) one after another, each removed once drained; size gets their
+// total up front
+template<typename element_T>
+source_t<element_T> concatenated(
+        std::function<std::string(size_t)> name,
+        size_t count,
+        void *ram,
+        size_t ram_size,
+        elements_size_t &size) {
+    struct state_t {
+        size_t next = 0;
+        std::string current;
+        source_t<element_T> source;
+    };
+    auto state = std::make_shared<state_t>();
+
+    size = 0;
+    for (size_t k = 0; k < count; k++) {
+        FILE *file = fopen(name(k).c_str(), "rb");
+        elements_size_t header = 0;
+
+        fread(&header, sizeof header, 1, file);
+        fclose(file);
+        size += header & ~PACKED_FILE;
+    }
+
+    return [state, name, count, ram, ram_size](element_T &val) {
+        while (!state->source || !state->source(val)) {
+            if (state->source) {
+                state->source = nullptr;
+                remove(state->current.c_str());
+            }
+            if (state->next == count) {
+                return false;
+            }
+            state->current = name(state->next++);
+            state->source = file_source<element_T>(state->current.c_str(), ram, ram_size);
+        }
+        return true;
+    };
+}
+
+// what a shard worker sends every worker at one exchange under tag, a file per receiver written through its
+// own block of ram; the files are complete once the sender is destroyed
+template<typename element_T>
+struct shard_sender_t {
+    const char *tag;
+    element_T *ram;
+    size_t block_size;
+    std::vector<FILE *> files;
+    std::vector<size_t> filled;
+    std::vector<elements_size_t> sizes;
+
+    shard_sender_t(const char *tag, void *ram, size_t ram_size) :
+            tag(tag),
+            ram((element_T *) ram),
+            block_size(ram_size / sizeof(element_T) / shards_t::instance().count),
+            files(shards_t::instance().count),
+            filled(files.size(), 0),
+            sizes(files.size(), 0) {
+        assert(block_size > 0);
+        for (size_t to = 0; to < files.size(); to++) {
+            files[to] = fopen(shards_t::exchange_name(tag, shards_t::instance().index, to).c_str(), "wb");
+            setvbuf(files[to], nullptr, _IONBF, 0);
+            fwrite(&sizes[to], sizeof sizes[to], 1, files[to]);
+        }
+    }
+
+    shard_sender_t(const shard_sender_t &) = delete;
+
+    void put(size_t to, const element_T &val) {
+        ram[to * block_size + filled[to]++] = val;
+        sizes[to]++;
+        if (filled[to] == block_size) {
+            flush(to);
+        }
+    }
+
+    ~shard_sender_t() {
+        for (size_t to = 0; to < files.size(); to++) {
+            flush(to);
+            fseek(files[to], 0, SEEK_SET);
+            fwrite(&sizes[to], sizeof sizes[to], 1, files[to]);
+            fclose(files[to]);
+        }
+    }
+
+private:
+    void flush(size_t to) {
+        counted_fwrite(ram + to * block_size, sizeof(element_T), filled[to], files[to]);
+        filled[to] = 0;
+    }
+};
+
+// what every worker sent this one under tag; every worker must be done sending
+template<typename element_T>
+source_t<element_T> shard_received(const char *tag, void *ram, size_t ram_size, elements_size_t &size) {
+    size_t to = shards_t::instance().index;
+
+    return concatenated<element_T>(
+            [tag, to](size_t from) { return shards_t::exchange_name(tag, from, to); },
+            shards_t::instance().count, ram, ram_size, size);
+}
+
+template<typename element_T>
+int cmp_elements(const void *l, const void *r) {
+    element_T left = *(element_T *) l;
+    element_T right = *(element_T *) r;
+
+    if (left < right) {
+        return -1;
+    } else if (left > right) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+// io cost model: a pass over the data costs its bytes read and written plus seek_bytes per block
+// transfer. The memory budget and seek_bytes are set at run time, so one build fits every machine
+struct cost_model_t {
+    static const size_t min_memory_size = 32 << 10;
+    static const size_t probe_block = 4096;
+    static const size_t probe_reads = 64;
+    static const size_t probe_sequential = 8 << 20;
+
+    size_t memory_size = DEFAULT_MEMORY_SIZE;
+    double seek_bytes = DEFAULT_SEEK_BYTES;
+    bool seek_bytes_given = false;
+    size_t shards = DEFAULT_SHARDS;
+
+    static cost_model_t &instance() {
+        static cost_model_t model;
+        return model;
+    }
+
+    // EXT_MEMORY_SIZE, EXT_SEEK_BYTES and EXT_SHARDS from the environment, then --memory=, --seek-bytes= and
+    // --shards= arguments; sizes take a k, m or g suffix
+    void configure(int argc, char const *argv[]) {
+        parse_size(getenv("EXT_MEMORY_SIZE"), memory_size);
+        seek_bytes_given |= parse_size(getenv("EXT_SEEK_BYTES"), seek_bytes);
+        parse_size(getenv("EXT_SHARDS"), shards);
+        for (int i = 1; i < argc; i++) {
+            if (!strncmp(argv[i], "--memory=", 9)) {
+                parse_size(argv[i] + 9, memory_size);
+            } else if (!strncmp(argv[i], "--seek-bytes=", 13)) {
+                seek_bytes_given |= parse_size(argv[i] + 13, seek_bytes);
+            } else if (!strncmp(argv[i], "--shards=", 9)) {
+                parse_size(argv[i] + 9, shards);
+            }
+        }
+        memory_size = std::max(memory_size, size_t(min_memory_size));
+        shards = std::max<size_t>(std::min(shards, memory_size / min_memory_size), 1); // min_memory_size each
+    }
+
+    // measures seek_bytes on the file about to be processed, as the process sees it (page cache included):
+    // scattered small reads against one sequential read. Inputs too small to time keep the default
+    void calibrate(const char *name) {
+        FILE *file = fopen(name, "rb");
+
+        if (seek_bytes_given || (file == nullptr)) {
+            if (file != nullptr) {
+                fclose(file);
+            }
+            return;
+        }
+        fseek(file, 0, SEEK_END);
+        auto file_size = static_cast<size_t>(ftell(file));
+        if (file_size >= 2 * probe_sequential) {
+            auto *buf = new char[probe_sequential];
+            int fd = fileno(file);
+
+            uint64_t start = io_stats_t::now_ns();
+            ssize_t done = pread(fd, buf, probe_sequential, 0);
+            uint64_t sequential_ns = io_stats_t::now_ns() - start;
+
+            start = io_stats_t::now_ns();
+            for (size_t i = 1; i <= probe_reads; i++) {
+                size_t offset = (i * 0x9e3779b97f4a7c15ull) % (file_size - probe_sequential - probe_block);
+                done += pread(fd, buf, probe_block, probe_sequential + offset / probe_block * probe_block);
+            }
+            uint64_t scattered_ns = io_stats_t::now_ns() - start;
+            (void) done;
+
+            double bytes_per_ns = double(probe_sequential) / std::max<uint64_t>(sequential_ns, 1);
+            double seek_ns = double(scattered_ns) / probe_reads - probe_block / bytes_per_ns;
+            seek_bytes = std::min(std::max(seek_ns * bytes_per_ns, 512.0), double(64 << 20));
+            delete[] buf;
+        }
+        fclose(file);
+    }
+
+    // share of merge ram for the rank input blocks, the output block gets the rest;
+    // minimizes the block transfers of one pass, rank / input + 1 / output
+    static double input_share(size_t rank) {
+        double root = std::sqrt(static_cast<double>(std::max<size_t>(rank, 1)));
+        return root / (1 + root);
+    }
+
+    // merge rank for runs_cnt runs: fewer passes against more seeks per pass,
+    // each input block keeps at least min_block bytes unless the rank is 2
+    size_t merge_rank(size_t runs_cnt, size_t ram_bytes, size_t min_block) const {
+        size_t best_rank = 2;
+        double best_cost = 0;
+
+        for (size_t rank = 2; rank <= std::max<size_t>(runs_cnt, 2); rank++) {
+            double input_block = ram_bytes * input_share(rank) / rank;
+            double output_block = ram_bytes - ram_bytes * input_share(rank);
+            size_t passes = 1;
+
+            if ((rank > 2) && (input_block < min_block)) {
+                break;
+            }
+            for (size_t runs = runs_cnt; runs > rank; runs = (runs + rank - 1) / rank) {
+                passes++;
+            }
+            double cost = passes * (2 + seek_bytes * (1 / input_block + 1 / output_block));
+            if ((rank == 2) || (cost < best_cost)) {
+                best_rank = rank;
+                best_cost = cost;
+            }
+        }
+        return best_rank;
+    }
+
+private:
+    template<typename value_T>
+    static bool parse_size(const char *text, value_T &value) {
+        if (text == nullptr) {
+            return false;
+        }
+        char *end = nullptr;
+        double parsed = strtod(text, &end);
+
+        if (end == text || parsed <= 0) {
+            return false;
+        }
+        static const char *const suffixes = "kmg";
+        const char *suffix = (*end != '\0') ? strchr(suffixes, tolower(*end)) : nullptr;
+        if (suffix != nullptr) {
+            parsed *= std::pow(1024.0, static_cast<double>(suffix - suffixes + 1));
+        }
+        value = static_cast<value_T>(parsed);
+        return true;
+    }
+};
+
+static size_t default_threads() {
+    size_t threads = DEFAULT_THREADS;
+
+    if (threads == 0) {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    if (shards_t::instance().worker) {
+        threads = std::max<size_t>(threads / shards_t::instance().count, 1); // the cores are shared
+    }
+    return threads;
+}
+
+// runs func(0) .. func(threads - 1) concurrently, func(0) on the calling thread
+template<typename func_T>
+void parallel_for(size_t threads, func_T func) {
+    auto *pool = new std::thread[threads];
+
+    for (size_t t = 1; t < threads; t++) {
+        pool[t] = std::thread(func, t);
+    }
+    func(0);
+    for (size_t t = 1; t < threads; t++) {
+        pool[t].join();
+    }
+    delete[] pool;
+}
+
+// LSD radix sort by key_T::key, one byte per pass; buf must hold size elements
+template<typename key_T, typename element_T>
+void radix_sort(element_T *data, element_T *buf, size_t size) {
+    typedef typename key_T::key_t key_t;
+    static const size_t digits = sizeof(key_t);
+    auto *counts = new size_t[digits][256]();
+
+    for (size_t i = 0; i < size; i++) {
+        key_t key = key_T::key(data[i]);
+        for (size_t d = 0; d < digits; d++) {
+            counts[d][(key >> (8 * d)) & 0xff]++;
+        }
+    }
+
+    element_T *src = data;
+    element_T *dst = buf;
+    for (size_t d = 0; d < digits; d++) {
+        size_t *offsets = counts[d];
+        if ((size == 0) || (offsets[(key_T::key(*src) >> (8 * d)) & 0xff] == size)) {
+            continue; // all keys share this byte
+        }
+        for (size_t b = 0, sum = 0; b < 256; b++) {
+            size_t cnt = offsets[b];
+            offsets[b] = sum;
+            sum += cnt;
+        }
+        for (size_t i = 0; i < size; i++) {
+            dst[offsets[(key_T::key(src[i]) >> (8 * d)) & 0xff]++] = src[i];
+        }
+        std::swap(src, dst);
+    }
+    if (src != data) {
+        memcpy(data, src, size * sizeof *data);
+    }
+    delete[] counts;
+}
+
+// same passes as radix_sort, each one split into per-thread histogram and scatter phases
+template<typename key_T, typename element_T>
+void parallel_radix_sort(element_T *data, element_T *buf, size_t size, size_t threads) {
+    typedef typename key_T::key_t key_t;
+    auto *counts = new size_t[threads][256];
+    element_T *src = data;
+    element_T *dst = buf;
+
+    threads = std::max<size_t>(std::min(threads, size), 1);
+    auto range_begin = [size, threads](size_t t) {
+        return size * t / threads;
+    };
+
+    for (size_t d = 0; d < sizeof(key_t); d++) {
+        auto digit = [d](const element_T &val) {
+            return (key_T::key(val) >> (8 * d)) & 0xff;
+        };
+
+        parallel_for(threads, [&](size_t t) {
+            std::fill(counts[t], counts[t] + 256, 0);
+            for (size_t i = range_begin(t); i < range_begin(t + 1); i++) {
+                counts[t][digit(src[i])]++;
+            }
+        });
+
+        size_t sum = 0;
+        bool single_bucket = false;
+        for (size_t b = 0; b < 256; b++) {
+            size_t bucket_start = sum;
+            for (size_t t = 0; t < threads; t++) {
+                size_t cnt = counts[t][b];
+                counts[t][b] = sum;
+                sum += cnt;
+            }
+            single_bucket = single_bucket || (sum - bucket_start == size);
+        }
+        if (single_bucket) {
+            continue; // all keys share this byte
+        }
+
+        parallel_for(threads, [&](size_t t) {
+            size_t *offsets = counts[t];
+            for (size_t i = range_begin(t); i < range_begin(t + 1); i++) {
+                dst[offsets[digit(src[i])]++] = src[i];
+            }
+        });
+        std::swap(src, dst);
+    }
+    if (src != data) {
+        memcpy(data, src, size * sizeof *data);
+    }
+    delete[] counts;
+}
+
+// records spread over buckets through one ram block each; a full block goes to its own exact-size spill extent
+template<typename element_T>
+struct spill_buckets_t {
+    struct bucket_t {
+        std::vector<run_t *> extents;
+        elements_size_t size = 0;
+    };
+
+    element_T *ram;
+    size_t block_size;
+    std::vector<bucket_t> buckets;
+    std::vector<size_t> filled;
+
+    spill_buckets_t(element_T *ram, size_t count, size_t block_size) :
+            ram(ram), block_size(block_size), buckets(count), filled(count, 0) {}
+
+    spill_buckets_t(const spill_buckets_t &) = delete;
+
+    void put(size_t b, const element_T &val) {
+        ram[b * block_size + filled[b]++] = val;
+        if (filled[b] == block_size) {
+            flush(b);
+        }
+    }
+
+    // writes out what is left in the blocks, ram is free afterwards
+    void flush() {
+        for (size_t b = 0; b < buckets.size(); b++) {
+            flush(b);
+        }
+    }
+
+    // the whole flushed bucket b into data
+    size_t read(size_t b, element_T *data) {
+        size_t read = 0;
+
+        for (run_t *extent : buckets[b].extents) {
+            spill_t::instance().open(extent);
+            read += counted_fread(data + read, sizeof *data, extent->bytes / sizeof *data, extent->file);
+            spill_t::instance().close(extent);
+        }
+        return read;
+    }
+
+    // the flushed bucket b streamed through buf; the buckets must outlive it
+    source_t<element_T> source(size_t b, element_T *buf, size_t buf_size) {
+        struct cursor_t {
+            size_t extent = 0;
+            size_t pos = 0;
+            size_t filled = 0;
+            uint64_t offset = 0; // bytes of the extent consumed
+        };
+        auto cursor = std::make_shared<cursor_t>();
+        std::vector<run_t *> *extents = &buckets[b].extents;
+
+        return [extents, cursor, buf, buf_size](element_T &val) {
+            while (cursor->pos == cursor->filled) {
+                if (cursor->extent == extents->size()) {
+                    return false;
+                }
+                run_t *extent = (*extents)[cursor->extent];
+                size_t cnt = std::min(static_cast<size_t>((extent->bytes - cursor->offset) / sizeof val), buf_size);
+
+                spill_t::instance().open(extent);
+                extent->seek(cursor->offset);
+                cursor->filled = counted_fread(buf, sizeof val, cnt, extent->file);
+                spill_t::instance().close(extent);
+                cursor->pos = 0;
+                cursor->offset += cnt * sizeof val;
+                if (cursor->offset == extent->bytes) {
+                    cursor->extent++;
+                    cursor->offset = 0;
+                }
+            }
+            val = buf[cursor->pos++];
+            return true;
+        };
+    }
+
+    // frees the extents of bucket b
+    void release(size_t b) {
+        for (run_t *extent : buckets[b].extents) {
+            spill_t::instance().free(extent);
+            delete extent;
+        }
+        buckets[b].extents.clear();
+    }
+
+    ~spill_buckets_t() {
+        for (size_t b = 0; b < buckets.size(); b++) {
+            release(b);
+        }
+    }
+
+private:
+    void flush(size_t b) {
+        if (filled[b] == 0) {
+            return;
+        }
+        run_t *extent = spill_t::instance().allocate(filled[b] * sizeof(element_T));
+
+        spill_t::instance().open(extent);
+        counted_fwrite(ram + b * block_size, sizeof(element_T), filled[b], extent->file);
+        spill_t::instance().close(extent);
+        buckets[b].extents.push_back(extent);
+        buckets[b].size += filled[b];
+        filled[b] = 0;
+    }
+};
+
+template<typename element_T>
+struct merger_t {
+    element_T *ram;
+    size_t ram_size_elements;
+    run_pool_t *runs;
+    bool self_alloc;
+
+    bool write_output_size = true;
+    bool replacement_selection = false;
+    bool mapped_io = DEFAULT_MAPPED_IO; // merge passes read runs through mmap
+    bool packed_io = DEFAULT_PACKED_IO; // runs are stored with record_codec_t
+    size_t threads;
+
+    merger_t(void *ram, size_t ram_size_bytes) :
+            ram((element_T *) ram),
+            ram_size_elements(ram_size_bytes / sizeof(element_T)),
+            runs(nullptr),
+            self_alloc(false),
+            threads(default_threads()) {}
+
+    size_t run_buffers(comparator_func_t) const {
+        return (threads > 1) ? 2 : 1; // parallel slices are merged through a scratch chunk
+    }
+
+    template<typename key_T>
+    size_t run_buffers(key_T) const {
+        return 2; // radix sort needs a scratch chunk
+    }
+
+    void sort_run(element_T *data, size_t size, comparator_func_t cmp) {
+        qsort(data, size, sizeof *data, cmp);
+    }
+
+    template<typename key_T>
+    void sort_run(element_T *data, size_t size, key_T) {
+        radix_sort<key_T>(data, data + size, size);
+    }
+
+    static comparator_func_t comparator(comparator_func_t cmp) {
+        return cmp;
+    }
+
+    template<typename key_T>
+    static comparator_func_t comparator(key_T) {
+        return key_T::cmp;
+    }
+
+    // bulk pull into buf, returns how many records were produced; 0 once the input is exhausted
+    typedef std::function<size_t(element_T *, size_t)> fill_func_t;
+
+    static fill_func_t file_fill(FILE *in, elements_size_t size) {
+        return [in, size](element_T *buf, size_t cnt) mutable {
+            auto read = static_cast<elements_size_t>(std::min<size_t>(cnt, size));
+
+            size -= read;
+            return counted_fread(buf, sizeof *buf, read, in);
+        };
+    }
+
+    static fill_func_t source_fill(source_t<element_T> source) {
+        return [source](element_T *buf, size_t cnt) {
+            size_t read = 0;
+
+            while ((read < cnt) && source(buf[read])) {
+                read++;
+            }
+            return read;
+        };
+    }
+
+    void reset_runs() {
+        delete runs;
+        runs = new run_pool_t();
+    }
+
+    // a packed run is encoded into scratch if given, otherwise over data itself
+    void write_run(element_T *data, size_t size, element_T *scratch = nullptr) {
+        auto run_size = static_cast<elements_size_t>(size) | (packed_io ? PACKED_FILE : 0);
+        run_t *run = runs->create(packed_io ? 0 : sizeof run_size + size * sizeof *data);
+        FILE *file = run->file;
+
+        fwrite(&run_size, sizeof run_size, 1, file);
+        if (!packed_io) {
+            counted_fwrite(data, sizeof *data, size, file);
+        } else {
+            auto *out = (uint8_t *) ((scratch != nullptr) ? scratch : data);
+            record_codec_t<element_T>::pack(
+                    data, size, out, size * sizeof *data,
+                    [file](const uint8_t *header, size_t header_len, const uint8_t *bytes, size_t len) {
+                        counted_fwrite(header, 1, header_len, file);
+                        counted_fwrite(bytes, 1, len, file);
+                    });
+        }
+        runs->put(run);
+    }
+
+    template<typename cmp_T>
+    void split_into_runs(fill_func_t fill, cmp_T cmp) {
+        size_t chunk_size = ram_size_elements / run_buffers(cmp);
+
+        reset_runs();
+        for (size_t read; (read = fill(ram, chunk_size)) != 0;) {
+            sort_run(ram, read, cmp);
+            write_run(ram, read);
+        }
+    }
+
+    // sorts data into a single run: slices are sorted in parallel, then merged pairwise back and forth
+    // between data and scratch, which holds size records unless there is a single slice
+    void sort_chunk(element_T *data, size_t size, element_T *scratch, comparator_func_t cmp) {
+        size_t pieces = std::max<size_t>(std::min(threads, size), 1);
+        auto bound = [size, pieces](size_t p) {
+            return size * std::min(p, pieces) / pieces;
+        };
+        auto less = [cmp](const element_T &l, const element_T &r) {
+            return cmp(&l, &r) < 0;
+        };
+        element_T *src = data;
+        element_T *dst = scratch;
+
+        parallel_for(pieces, [=](size_t t) {
+            qsort(data + bound(t), bound(t + 1) - bound(t), sizeof *data, cmp);
+        });
+        for (size_t width = 1; width < pieces; width *= 2) {
+            parallel_for((pieces + 2 * width - 1) / (2 * width), [=](size_t m) {
+                size_t first = 2 * width * m;
+                std::merge(src + bound(first), src + bound(first + width),
+                           src + bound(first + width), src + bound(first + 2 * width),
+                           dst + bound(first), less);
+            });
+            std::swap(src, dst);
+        }
+        if (src != data) {
+            std::copy(src, src + size, data);
+        }
+    }
+
+    template<typename key_T>
+    void sort_chunk(element_T *data, size_t size, element_T *scratch, key_T) {
+        parallel_radix_sort<key_T>(data, scratch, size, threads);
+    }
+
+    // pipelined run formation: chunk i + 1 is read and chunk i - 1 written while chunk i is sorted
+    template<typename cmp_T>
+    void split_into_runs_pipelined(fill_func_t fill, cmp_T cmp) {
+        static const size_t slots = 3;
+        size_t chunk_size = ram_size_elements / (slots + run_buffers(cmp) - 1);
+        size_t lens[slots]{};
+        size_t chunks_cnt = SIZE_MAX - 2; // known once fill comes up short
+        element_T *scratch = ram + slots * chunk_size; // radix sort and the merge of parallel slices
+        auto chunk = [this, chunk_size](size_t i) {
+            return ram + (i % slots) * chunk_size;
+        };
+
+        reset_runs();
+        for (size_t step = 0; step < chunks_cnt + 2; step++) {
+            std::thread reader;
+            std::thread writer;
+
+            if (step < chunks_cnt) {
+                reader = std::thread([&, step]() {
+                    lens[step % slots] = fill(chunk(step), chunk_size);
+                });
+            }
+            if (step >= 2) {
+                writer = std::thread([&, step]() {
+                    size_t i = step - 2;
+
+                    write_run(chunk(i), lens[i % slots]);
+                });
+            }
+            if ((step >= 1) && (step - 1 < chunks_cnt)) {
+                size_t i = step - 1;
+                sort_chunk(chunk(i), lens[i % slots], scratch, cmp);
+            }
+
+            if (reader.joinable()) {
+                reader.join();
+            }
+            if (writer.joinable()) {
+                writer.join();
+            }
+            if ((step < chunks_cnt) && (lens[step % slots] < chunk_size)) {
+                chunks_cnt = step + ((lens[step % slots] != 0) ? 1 : 0);
+            }
+        }
+    }
+
+    // replacement selection: runs are ~2x the heap on random input, a single run on sorted input
+    template<typename cmp_T>
+    void select_into_runs(fill_func_t fill, cmp_T sort_cmp) {
+        comparator_func_t cmp = comparator(sort_cmp);
+        auto greater = [cmp](const element_T &l, const element_T &r) {
+            return cmp(&l, &r) > 0;
+        };
+        size_t io_block_size = std::max<size_t>(ram_size_elements / 16, 1);
+        size_t capacity = ram_size_elements - 2 * io_block_size;
+        element_T *heap = ram; // current run: [0, heap_size), next run: [heap_size, pending_end)
+        element_T *in_block = ram + capacity;
+        element_T *out_block = ram + capacity + io_block_size;
+        size_t in_pos = 0;
+        size_t in_len = 0;
+        auto pull = [&](element_T &val) {
+            if (in_pos == in_len) {
+                in_len = fill(in_block, io_block_size);
+                in_pos = 0;
+            }
+            if (in_len == 0) {
+                return false;
+            }
+            val = in_block[in_pos++];
+            return true;
+        };
+
+        assert(capacity > 0);
+        reset_runs();
+
+        size_t heap_size = 0;
+        while ((heap_size < capacity) && pull(heap[heap_size])) {
+            heap_size++;
+        }
+        size_t pending_end = heap_size;
+
+        while (heap_size > 0) {
+            std::make_heap(heap, heap + heap_size, greater);
+
+            run_t *run = runs->create();
+            block_writer_t<element_T> writer(run->file, out_block, io_block_size, packed_io);
+            elements_size_t run_size = 0;
+
+            fwrite(&run_size, sizeof run_size, 1, run->file); // rewritten once the run is complete
+            element_T next{};
+
+            while (heap_size > 0) {
+                writer.put(heap[0]);
+                run_size++;
+
+                if (!pull(next)) {
+                    heap[0] = heap[--heap_size];
+                    heap[heap_size] = heap[--pending_end]; // close the gap in the next run
+                } else if (cmp(&next, heap) >= 0) {
+                    heap[0] = next;
+                } else {
+                    heap[0] = heap[--heap_size];
+                    heap[heap_size] = next;
+                }
+                sift_down(heap, heap_size, cmp);
+            }
+            writer.flush();
+            run_size |= packed_io ? PACKED_FILE : 0;
+            long end = ftell(run->file);
+            run->seek(0);
+            fwrite(&run_size, sizeof run_size, 1, run->file);
+            fseek(run->file, end, SEEK_SET);
+            runs->put(run);
+
+            heap_size = pending_end;
+        }
+    }
+
+    static void sift_down(element_T *heap, size_t size, comparator_func_t cmp) {
+        element_T val = heap[0];
+        size_t i = 0;
+
+        for (size_t child; (child = 2 * i + 1) < size; i = child) {
+            if ((child + 1 < size) && (cmp(&heap[child + 1], &heap[child]) < 0)) {
+                child++;
+            }
+            if (cmp(&heap[child], &val) >= 0) {
+                break;
+            }
+            heap[i] = heap[child];
+        }
+        heap[i] = val;
+    }
+
+    template<typename cmp_T>
+    void form_runs(fill_func_t fill, cmp_T cmp) {
+        if (replacement_selection) {
+            select_into_runs(fill, cmp);
+        } else if (threads > 1) {
+            split_into_runs_pipelined(fill, cmp);
+        } else {
+            split_into_runs(fill, cmp);
+        }
+    }
+
+    // k-way loser-tree merge of sorted files, pulled one record at a time
+    struct merge_cursor_t {
+        struct input {
+            block_reader_t<element_T> reader;
+            const element_T *val = nullptr;
+            bool exhausted = false;
+        };
+
+        size_t rank;
+        comparator_func_t cmp;
+        input *inputs;
+        size_t *losers; // losers[0] holds the overall winner
+        bool popped;
+        elements_size_t size;
+
+        merge_cursor_t(
+                FILE *files[],
+                size_t rank,
+                comparator_func_t cmp,
+                element_T *buf,
+                size_t block_size,
+                bool mapped) :
+                rank(rank),
+                cmp(cmp),
+                inputs(new input[rank]()),
+                losers(new size_t[std::max<size_t>(rank, 1)]()),
+                popped(false),
+                size(0) {
+            auto *winners = new size_t[2 * rank]();
+
+            for (size_t i = 0; i < rank; i++) {
+                elements_size_t input_size = 0;
+                fread(&input_size, sizeof input_size, 1, files[i]);
+                bool packed = (input_size & PACKED_FILE) != 0;
+                input_size &= ~PACKED_FILE;
+                inputs[i].reader = block_reader_t<element_T>(
+                        files[i], buf + i * block_size, block_size, input_size, mapped, packed);
+                size += input_size;
+            }
+
+            // leaves are at [rank, 2 * rank), node n plays between 2n and 2n + 1
+            for (size_t i = 0; i < rank; i++) {
+                advance(i);
+                winners[rank + i] = i;
+            }
+            for (size_t n = rank - 1; (rank > 0) && (n > 0); n--) {
+                size_t l = winners[2 * n];
+                size_t r = winners[2 * n + 1];
+                winners[n] = less(l, r) ? l : r;
+                losers[n] = less(l, r) ? r : l;
+            }
+            losers[0] = (rank > 1) ? winners[1] : 0;
+            delete[] winners;
+        }
+
+        merge_cursor_t(const merge_cursor_t &) = delete;
+
+        // smallest record left, valid until the next call; nullptr once all inputs are exhausted
+        const element_T *next() {
+            if (rank == 0) {
+                return nullptr;
+            }
+            if (popped) {
+                // the previous winner is only replaced now, so its record stays readable until this call
+                size_t winner = losers[0];
+
+                advance(winner);
+                for (size_t n = (rank + winner) / 2; n > 0; n /= 2) {
+                    if (less(losers[n], winner)) {
+                        std::swap(losers[n], winner);
+                    }
+                }
+                losers[0] = winner;
+            }
+            popped = !inputs[losers[0]].exhausted;
+            return popped ? inputs[losers[0]].val : nullptr;
+        }
+
+        ~merge_cursor_t() {
+            delete[] losers;
+            delete[] inputs;
+        }
+
+    private:
+        void advance(size_t i) {
+            auto &inp = inputs[i];
+            if (inp.reader.empty()) {
+                inp.exhausted = true;
+                return;
+            }
+            inp.val = &inp.reader.next();
+        }
+
+        bool less(size_t l, size_t r) const {
+            if (inputs[l].exhausted || inputs[r].exhausted) {
+                return !inputs[l].exhausted;
+            }
+            int res = cmp(inputs[l].val, inputs[r].val);
+            return (res < 0) || ((res == 0) && (l < r)); // keep merge stable
+        }
+    };
+
+    void merge(
+            FILE *files[],
+            size_t rank,
+            FILE *result,
+            comparator_func_t cmp,
+            element_T *in_buf,
+            size_t in_block_size,
+            element_T *out_buf,
+            size_t out_block_size,
+            bool write_size = true,
+            bool packed_result = false) {
+        merge_cursor_t cursor(files, rank, cmp, in_buf, in_block_size, mapped_io);
+
+        io_stats_t::instance().merge_passes++;
+        if (write_size) {
+            elements_size_t header = cursor.size | (packed_result ? PACKED_FILE : 0);
+            fwrite(&header, sizeof header, 1, result);
+        }
+        block_writer_t<element_T> writer(result, out_buf, out_block_size, packed_result);
+        for (const element_T *val; (val = cursor.next()) != nullptr;) {
+            writer.put(*val);
+        }
+        writer.flush();
+    }
+
+    size_t pick_merge_rank(size_t runs_cnt) const {
+        size_t rank = cost_model_t::instance().merge_rank(
+                runs_cnt, ram_size_elements * sizeof(element_T), DEFAULT_MIN_MERGE_BLOCK_SIZE);
+
+        return std::max(std::min(rank, ram_size_elements / 2), size_t(2));
+    }
+
+    // input block of a rank-way merge in ram_elements, the output block gets the rest
+    static size_t input_block_size(size_t ram_elements, size_t rank) {
+        rank = std::max<size_t>(rank, 1);
+        return std::max<size_t>(static_cast<size_t>(ram_elements * cost_model_t::input_share(rank)) / rank, 1);
+    }
+
+    // merges runs until at most rank are left for the final pass
+    void merge_runs(comparator_func_t cmp, size_t rank) {
+        size_t block_size = input_block_size(ram_size_elements, rank);
+        size_t result_block_size = ram_size_elements - rank * block_size;
+        auto *result_block = ram + rank * block_size;
+
+        assert(block_size > 0);
+        assert(result_block_size > 0);
+        assert((rank * block_size + result_block_size) <= ram_size_elements);
+
+        auto files = new FILE *[rank];
+        auto **used_runs = new run_t *[rank];
+
+        while (runs->size() > rank) {
+            // just enough runs to leave rank of them, so the final pass does the rest
+            size_t files_cnt = std::min(rank, runs->size() - rank + 1);
+            uint64_t bytes = sizeof(elements_size_t); // raw result: the records of its inputs
+
+            for (size_t i = 0; i < files_cnt; i++) {
+                used_runs[i] = runs->get();
+                files[i] = used_runs[i]->file;
+                bytes += used_runs[i]->bytes - sizeof(elements_size_t);
+            }
+
+            run_t *result = runs->create(packed_io ? 0 : bytes);
+            merge(files, files_cnt, result->file, cmp, ram, block_size, result_block, result_block_size,
+                  true, packed_io);
+            runs->put(result);
+            for (size_t i = 0; i < files_cnt; i++) {
+                runs->release(used_runs[i]);
+            }
+        }
+
+        delete[] used_runs;
+        delete[] files;
+    }
+
+    // merges the formed runs into out
+    void merge_into(FILE *out, comparator_func_t cmp, size_t rank) {
+        if (rank == 0) {
+            rank = pick_merge_rank(runs->size());
+        }
+        merge_runs(cmp, rank);
+
+        size_t files_cnt = runs->size();
+        size_t block_size = input_block_size(ram_size_elements, files_cnt);
+        size_t inputs_size = block_size * files_cnt;
+        auto files = new FILE *[files_cnt];
+        auto **used_runs = new run_t *[files_cnt];
+
+        for (size_t i = 0; i < files_cnt; i++) {
+            used_runs[i] = runs->get();
+            files[i] = used_runs[i]->file;
+        }
+        merge(files, files_cnt, out, cmp, ram, block_size, ram + inputs_size, ram_size_elements - inputs_size,
+              write_output_size);
+        for (size_t i = 0; i < files_cnt; i++) {
+            runs->release(used_runs[i]);
+        }
+
+        delete[] used_runs;
+        delete[] files;
+    }
+
+    template<typename cmp_T>
+    void sort_into(fill_func_t fill, FILE *out, cmp_T sort_cmp, size_t rank) {
+        form_runs(fill, sort_cmp);
+        merge_into(out, comparator(sort_cmp), rank);
+    }
+
+    template<typename cmp_T = comparator_func_t>
+    void do_merge_sort(
+            FILE *in,
+            FILE *out,
+            cmp_T sort_cmp = cmp_elements<element_T>,
+            size_t rank = DEFAULT_MERGE_RANK) {
+        elements_size_t size = 0;
+
+        fread(&size, sizeof size, 1, in);
+        sort_into(file_fill(in, size), out, sort_cmp, rank);
+    }
+
+    template<typename cmp_T = comparator_func_t>
+    void sort(
+            const char *input_name,
+            const char *output_name,
+            cmp_T cmp = cmp_elements<element_T>,
+            size_t merge_rank = DEFAULT_MERGE_RANK) {
+        FILE *input = fopen(input_name, "rb");
+        FILE *output = fopen(output_name, "wb");
+
+        setvbuf(input, nullptr, _IONBF, 0);
+        setvbuf(output, nullptr, _IONBF, 0);
+        do_merge_sort(input, output, cmp, merge_rank);
+
+        fclose(input);
+        fclose(output);
+    }
+
+    // sorts everything pulled from source into output_name
+    template<typename cmp_T = comparator_func_t>
+    void sort(
+            source_t<element_T> source,
+            const char *output_name,
+            cmp_T cmp = cmp_elements<element_T>,
+            size_t merge_rank = DEFAULT_MERGE_RANK) {
+        FILE *output = fopen(output_name, "wb");
+
+        setvbuf(output, nullptr, _IONBF, 0);
+        sort_into(source_fill(source), output, cmp, merge_rank);
+        fclose(output);
+    }
+
+    // one scan of source forms runs for every ordering at once, output_names[k] gets the records sorted by cmps[k]
+    template<typename... cmp_T>
+    void multi_sort(source_t<element_T> source, const char *const output_names[], cmp_T... cmps) {
+        static const size_t orderings = sizeof...(cmp_T);
+        comparator_func_t comparators[] = {comparator(cmps)...};
+        // the chunk is sorted again after its runs are written, so packing needs the scratch chunk too
+        size_t chunk_size = ram_size_elements / std::max({run_buffers(cmps)..., size_t(packed_io ? 2 : 1)});
+        element_T *scratch = ram + chunk_size; // radix sort and packing
+        run_pool_t *pools[orderings];
+        fill_func_t fill = source_fill(source);
+
+        delete runs; // a pool left attached by an earlier sort
+        runs = nullptr;
+        for (size_t k = 0; k < orderings; k++) {
+            pools[k] = new run_pool_t();
+        }
+        // a chunk is sorted by each ordering in turn, earlier sorts do not affect later ones
+        for (size_t read; (read = fill(ram, chunk_size)) != 0;) {
+            size_t k = 0;
+            bool expand[] = {write_chunk_run(pools[k++], read, scratch, cmps)...};
+            (void) expand;
+        }
+
+        for (size_t k = 0; k < orderings; k++) {
+            FILE *output = fopen(output_names[k], "wb");
+
+            setvbuf(output, nullptr, _IONBF, 0);
+            runs = pools[k];
+            merge_into(output, comparators[k], DEFAULT_MERGE_RANK);
+            fclose(output);
+            delete runs;
+        }
+        runs = nullptr;
+    }
+
+    template<typename cmp_T>
+    bool write_chunk_run(run_pool_t *pool, size_t size, element_T *scratch, cmp_T cmp) {
+        sort_chunk(ram, size, scratch, cmp);
+        runs = pool;
+        write_run(ram, size, scratch);
+        return true;
+    }
+
+    // sorts everything pulled from source, the final merge pass is pulled from the returned source;
+    // it uses the whole merger ram until drained
+    template<typename cmp_T = comparator_func_t>
+    source_t<element_T> sorted(
+            source_t<element_T> source,
+            cmp_T sort_cmp = cmp_elements<element_T>,
+            size_t rank = DEFAULT_MERGE_RANK) {
+        struct state_t {
+            size_t files_cnt;
+            run_t **used_runs;
+            merge_cursor_t *cursor;
+
+            ~state_t() {
+                delete cursor;
+                for (size_t i = 0; i < files_cnt; i++) {
+                    run_pool_t::release(used_runs[i]);
+                }
+                delete[] used_runs;
+            }
+        };
+        comparator_func_t cmp = comparator(sort_cmp);
+
+        form_runs(source_fill(source), sort_cmp);
+        if (rank == 0) {
+            rank = pick_merge_rank(runs->size());
+        }
+        merge_runs(cmp, rank);
+
+        size_t files_cnt = runs->size();
+        size_t block_size = ram_size_elements / std::max<size_t>(files_cnt, 1);
+        auto files = new FILE *[files_cnt];
+        auto state = std::make_shared<state_t>();
+
+        state->files_cnt = files_cnt;
+        state->used_runs = new run_t *[files_cnt];
+        for (size_t i = 0; i < files_cnt; i++) {
+            state->used_runs[i] = runs->get();
+            files[i] = state->used_runs[i]->file;
+        }
+        state->cursor = new merge_cursor_t(files, files_cnt, cmp, ram, block_size, mapped_io);
+        io_stats_t::instance().merge_passes++;
+        delete[] files;
+
+        return [state](element_T &val) {
+            const element_T *next = state->cursor->next();
+            if (next == nullptr) {
+                return false;
+            }
+            val = *next;
+            return true;
+        };
+    }
+
+    // distribution sort by key_T for keys expected in [lo, hi]: one pass spreads the records over key-range
+    // buckets sized to fit ram, then each bucket is sorted in memory as it is pulled. lo, hi and size (the
+    // expected record count) only shape the buckets: keys outside go to the first or last bucket and a bucket
+    // that outgrows ram is merge sorted on its own. Falls back to sorted() if the bucket blocks would be
+    // smaller than DEFAULT_MIN_MERGE_BLOCK_SIZE; it uses the whole merger ram until drained
+    template<typename key_T>
+    source_t<element_T> distributed(
+            source_t<element_T> source,
+            key_T key,
+            typename key_T::key_t lo,
+            typename key_T::key_t hi,
+            elements_size_t size) {
+        typedef typename key_T::key_t key_t;
+        struct state_t {
+            merger_t *merger;
+            spill_buckets_t<element_T> *buckets;
+            size_t current; // bucket being pulled
+            size_t filled; // its records, sorted at the start of ram
+            size_t pos;
+            merger_t *overflow; // sorts a bucket larger than chunk
+            source_t<element_T> overflow_sorted;
+
+            ~state_t() {
+                delete overflow;
+                delete buckets;
+            }
+        };
+        size_t read_block_size = std::max<size_t>(ram_size_elements / 16, 1);
+        size_t chunk_size = (ram_size_elements - read_block_size) / 2; // radix sort needs a scratch chunk
+        auto buckets_cnt = static_cast<size_t>(std::max<elements_size_t>((size + size / 4) / chunk_size + 1, 1));
+        size_t block_size = ram_size_elements / buckets_cnt;
+
+        if ((chunk_size == 0) || ((buckets_cnt > 1) && (block_size * sizeof(element_T) < DEFAULT_MIN_MERGE_BLOCK_SIZE))) {
+            return sorted(source, key);
+        }
+
+        auto state = std::make_shared<state_t>();
+        auto span = static_cast<double>(hi > lo ? hi - lo : 0) + 1;
+
+        state->merger = this;
+        state->buckets = new spill_buckets_t<element_T>(ram, buckets_cnt, block_size);
+        state->current = 0;
+        state->filled = 0;
+        state->pos = 0;
+        state->overflow = nullptr;
+        for (element_T val; source(val);) {
+            key_t k = key_T::key(val);
+            double at = (k > lo) ? static_cast<double>(k - lo) / span * buckets_cnt : 0;
+
+            state->buckets->put(std::min(static_cast<size_t>(at), buckets_cnt - 1), val);
+        }
+        state->buckets->flush();
+        io_stats_t::instance().merge_passes++;
+
+        return [state, chunk_size, read_block_size, key](element_T &val) {
+            merger_t *merger = state->merger;
+
+            while (true) {
+                if (state->overflow != nullptr) {
+                    if (state->overflow_sorted(val)) {
+                        return true;
+                    }
+                    state->overflow_sorted = nullptr;
+                    delete state->overflow;
+                    state->overflow = nullptr;
+                    state->buckets->release(state->current++);
+                } else if (state->pos < state->filled) {
+                    val = merger->ram[state->pos++];
+                    return true;
+                } else if (state->filled != 0) {
+                    state->filled = 0;
+                    state->buckets->release(state->current++);
+                }
+                if (state->current == state->buckets->buckets.size()) {
+                    return false;
+                }
+
+                if (state->buckets->buckets[state->current].size > chunk_size) {
+                    size_t sort_size = merger->ram_size_elements - read_block_size;
+
+                    state->overflow = new merger_t(merger->ram, sort_size * sizeof(element_T));
+                    state->overflow->threads = merger->threads;
+                    state->overflow->mapped_io = merger->mapped_io;
+                    state->overflow->packed_io = merger->packed_io;
+                    state->overflow_sorted = state->overflow->sorted(
+                            state->buckets->source(state->current, merger->ram + sort_size, read_block_size), key);
+                    continue;
+                }
+                size_t read = state->buckets->read(state->current, merger->ram);
+
+                merger->sort_chunk(merger->ram, read, merger->ram + chunk_size, key);
+                state->filled = read;
+                state->pos = 0;
+                if (read == 0) {
+                    state->current++;
+                }
+            }
+        };
+    }
+
+    ~merger_t() {
+        if (self_alloc) {
+            delete[] ram;
+        }
+        delete runs;
+    }
+};
+
+template<typename element_T, size_t len>
+struct tuple {
+    element_T elem[len];
+
+    typedef element_T element_t;
+};
+
+tuple<uint32_t, 3> &join_deuces(
+        const tuple<uint32_t, 2> &l,
+        const tuple<uint32_t, 2> &r,
+        tuple<uint32_t, 3> &res) {
+    res.elem[0] = l.elem[0];
+    res.elem[1] = l.elem[1];
+    res.elem[2] = r.elem[1];
+    return res;
+}
+
+// open-addressing multimap of records by key_T::key in caller ram, linear probing;
+// a bitmap marks used slots, so a slot costs sizeof(element_T) plus one bit
+template<typename element_T, typename key_T>
+struct hash_table_t {
+    typedef typename key_T::key_t key_t;
+
+    static const size_t npos = SIZE_MAX;
+
+    element_T *slots;
+    uint8_t *used;
+    size_t slots_cnt;
+    size_t size;
+
+    // records that fit into ram_size bytes at a load of at most 7/8
+    static size_t capacity(size_t ram_size) {
+        return slots_for(ram_size) / 8 * 7;
+    }
+
+    hash_table_t(void *ram, size_t ram_size) :
+            slots((element_T *) ram),
+            slots_cnt(std::max<size_t>(slots_for(ram_size), 1)),
+            size(0) {
+        used = (uint8_t *) (slots + slots_cnt);
+        memset(used, 0, (slots_cnt + 7) / 8);
+    }
+
+    // false once the table is at capacity
+    bool insert(const element_T &val) {
+        if (size >= capacity_slots()) {
+            return false;
+        }
+        size_t i = home(key_T::key(val));
+
+        while (is_used(i)) {
+            i = (i + 1) % slots_cnt;
+        }
+        slots[i] = val;
+        used[i / 8] |= uint8_t(1u << (i % 8));
+        size++;
+        return true;
+    }
+
+    // slot of the first record with key from slot from on, npos if none; start with find(key, home(key))
+    size_t find(key_t key, size_t from) const {
+        for (size_t i = from; is_used(i); i = (i + 1) % slots_cnt) {
+            if (key_T::key(slots[i]) == key) {
+                return i;
+            }
+        }
+        return npos;
+    }
+
+    size_t home(key_t key) const {
+        auto x = static_cast<uint64_t>(key) * 0x9e3779b97f4a7c15ull;
+
+        x = (x ^ (x >> 31)) * 0xbf58476d1ce4e5b9ull;
+        return static_cast<size_t>((x ^ (x >> 29)) % slots_cnt);
+    }
+
+    size_t next(size_t i) const {
+        return (i + 1) % slots_cnt;
+    }
+
+private:
+    static size_t slots_for(size_t ram_size) {
+        return ram_size * 8 / (sizeof(element_T) * 8 + 1);
+    }
+
+    size_t capacity_slots() const {
+        return std::min(slots_cnt / 8 * 7, slots_cnt - 1); // an empty slot always ends a probe
+    }
+
+    bool is_used(size_t i) const {
+        return (used[i / 8] >> (i % 8)) & 1u;
+    }
+};
+
+template<
+        typename left_src_T,
+        typename right_src_T,
+        typename target_T
+>
+struct joiner_t {
+
+    typedef left_src_T left_src_t;
+    typedef right_src_T right_src_t;
+    typedef target_T target_t;
+    typedef std::function<bool(const left_src_t &, const right_src_t &, target_t &)> joiner_func_t;
+    typedef std::function<bool(const left_src_t &, const right_src_t &)> joiner_predicate_t;
+    // general joins call it once per matching right record, or once with nullptr for a left record
+    // matching none (left outer join); the result is produced if it returns true
+    typedef std::function<bool(const left_src_t &, const right_src_t *, target_t &)> matcher_func_t;
+
+    char *ram;
+    size_t ram_size_bytes;
+    bool self_alloc;
+    bool mapped_io = DEFAULT_MAPPED_IO;
+    bool packed_io = false; // results are stored with record_codec_t, inputs tell by their headers
+
+    // all three streams advance one record per joined record, so the block transfers
+    // sum(size_i / block_i) are fewest with blocks in proportion to the square roots of tuple sizes
+    struct streams_t {
+        block_reader_t<left_src_t> left;
+        block_reader_t<right_src_t> right;
+        block_writer_t<target_t> result;
+
+        streams_t(
+                const joiner_t &joiner,
+                FILE *left, elements_size_t left_size,
+                FILE *right, elements_size_t right_size,
+                FILE *result) {
+            double roots = std::sqrt(double(sizeof(left_src_t))) + std::sqrt(double(sizeof(right_src_t)))
+                    + std::sqrt(double(sizeof(target_t)));
+            auto share = [&joiner, roots](size_t tuple_size) {
+                return static_cast<size_t>(joiner.ram_size_bytes * std::sqrt(double(tuple_size)) / roots) / tuple_size;
+            };
+            size_t left_block_size = share(sizeof(left_src_t));
+            size_t right_block_size = share(sizeof(right_src_t));
+            size_t result_block_size = (joiner.ram_size_bytes
+                    - left_block_size * sizeof(left_src_t)
+                    - right_block_size * sizeof(right_src_t)) / sizeof(target_t);
+            char *ram = joiner.ram;
+
+            assert(left_block_size > 0);
+            assert(right_block_size > 0);
+            assert(result_block_size > 0);
+
+            this->left = block_reader_t<left_src_t>(
+                    left, (left_src_t *) ram, left_block_size, left_size & ~PACKED_FILE,
+                    joiner.mapped_io, (left_size & PACKED_FILE) != 0);
+            ram += left_block_size * sizeof(left_src_t);
+            this->right = block_reader_t<right_src_t>(
+                    right, (right_src_t *) ram, right_block_size, right_size & ~PACKED_FILE,
+                    joiner.mapped_io, (right_size & PACKED_FILE) != 0);
+            ram += right_block_size * sizeof(right_src_t);
+            this->result = block_writer_t<target_t>(result, (target_t *) ram, result_block_size, joiner.packed_io);
+        }
+    };
+
+    joiner_t(char *ram, size_t ram_size_bytes) :
+            ram(ram),
+            ram_size_bytes(ram_size_bytes),
+            self_alloc(false) {}
+
+    void join(
+            FILE *left,
+            FILE *right,
+            FILE *result,
+            joiner_func_t joiner_func) {
+        elements_size_t left_size;
+        elements_size_t right_size;
+        fread(&left_size, sizeof left_size, 1, left);
+        fread(&right_size, sizeof right_size, 1, right);
+        streams_t streams(*this, left, left_size, right, right_size, result);
+        left_size &= ~PACKED_FILE;
+        write_header(result, left_size);
+
+        for (elements_size_t i = 0; i < left_size; i++) {
+            target_t res{};
+
+            joiner_func(streams.left.next(), streams.right.next(), res);
+            streams.result.put(res);
+        }
+        streams.result.flush();
+        io_stats_t::instance().records_joined += left_size;
+    }
+
+    void left_join(
+            FILE *left,
+            FILE *right,
+            FILE *result,
+            joiner_func_t joiner_func
+    ) {
+        elements_size_t left_size;
+        elements_size_t right_size;
+        fread(&left_size, sizeof left_size, 1, left);
+        fread(&right_size, sizeof right_size, 1, right);
+        streams_t streams(*this, left, left_size, right, right_size, result);
+        left_size &= ~PACKED_FILE;
+        write_header(result, left_size);
+        bool right_consumed = true;
+
+        right_src_t r{};
+        target_t res{};
+        for (elements_size_t i = 0; i < left_size; i++) {
+            if (right_consumed && !streams.right.empty()) {
+                r = streams.right.next();
+            }
+            right_consumed = joiner_func(streams.left.next(), r, res);
+            streams.result.put(res);
+        }
+        streams.result.flush();
+        io_stats_t::instance().records_joined += left_size;
+    }
+
+    void write_header(FILE *result, elements_size_t size) const {
+        size |= packed_io ? PACKED_FILE : 0;
+        fwrite(&size, sizeof size, 1, result);
+    }
+
+    // same as left_join over files, joined records are produced as they are pulled
+    static source_t<target_t> left_join(
+            source_t<left_src_t> left,
+            source_t<right_src_t> right,
+            joiner_func_t joiner_func) {
+        struct state_t {
+            source_t<left_src_t> left;
+            source_t<right_src_t> right;
+            joiner_func_t joiner_func;
+            right_src_t r;
+            bool right_consumed;
+            uint64_t joined;
+        };
+        auto state = std::make_shared<state_t>(state_t{left, right, joiner_func, right_src_t{}, true, 0});
+
+        return [state](target_t &res) {
+            left_src_t l{};
+            right_src_t r{};
+
+            if (!state->left(l)) {
+                io_stats_t::instance().records_joined += state->joined; // counted once, off the hot path
+                state->joined = 0;
+                return false;
+            }
+            if (state->right_consumed && state->right(r)) {
+                state->r = r;
+            }
+            state->right_consumed = state->joiner_func(l, state->r, res);
+            state->joined++;
+            return true;
+        };
+    }
+
+    // many-to-many equi-join of sources sorted by left_key_T and right_key_T; the right records of the current
+    // key are held in group_ram, a larger group spills to a run that is read back for each matching left record
+    template<typename left_key_T, typename right_key_T>
+    static source_t<target_t> merge_join(
+            source_t<left_src_t> left,
+            source_t<right_src_t> right,
+            matcher_func_t matcher_func,
+            char *group_ram,
+            size_t group_ram_size) {
+        typedef typename left_key_T::key_t key_t;
+        struct state_t {
+            source_t<left_src_t> left;
+            source_t<right_src_t> right;
+            matcher_func_t matcher_func;
+            right_src_t *group; // right records of group_key, or a block of them once spilled
+            size_t capacity;
+            size_t group_size;
+            size_t block_begin; // group index of group[0]
+            size_t block_len;
+            run_pool_t spills;
+            run_t *spill; // the whole group if it outgrew group_ram, nullptr otherwise
+            key_t group_key;
+            right_src_t ahead; // first right record past the group
+            bool ahead_valid;
+            left_src_t l;
+            size_t pos; // next group record to join l with, SIZE_MAX: pull the next l
+            uint64_t joined;
+
+            void release_spill() {
+                if (spill != nullptr) {
+                    run_pool_t::release(spill);
+                    spill = nullptr;
+                }
+            }
+
+            ~state_t() {
+                release_spill();
+            }
+        };
+        auto state = std::make_shared<state_t>();
+
+        state->left = left;
+        state->right = right;
+        state->matcher_func = matcher_func;
+        state->group = (right_src_t *) group_ram;
+        state->capacity = group_ram_size / sizeof(right_src_t);
+        state->group_size = 0;
+        state->block_begin = 0;
+        state->block_len = 0;
+        state->spill = nullptr;
+        state->ahead_valid = state->right(state->ahead);
+        state->pos = SIZE_MAX;
+        state->joined = 0;
+        assert(state->capacity > 0);
+
+        return [state](target_t &res) {
+            while (true) {
+                if (state->pos == SIZE_MAX) {
+                    if (!state->left(state->l)) {
+                        io_stats_t::instance().records_joined += state->joined;
+                        state->joined = 0;
+                        return false;
+                    }
+                    state->joined++;
+                    key_t key = left_key_T::key(state->l);
+
+                    if ((state->group_size == 0) || (state->group_key != key)) {
+                        size_t filled = 0;
+
+                        state->release_spill();
+                        state->group_size = 0;
+                        while (state->ahead_valid && (right_key_T::key(state->ahead) < key)) {
+                            state->ahead_valid = state->right(state->ahead);
+                        }
+                        while (state->ahead_valid && (right_key_T::key(state->ahead) == key)) {
+                            if (filled == state->capacity) { // group_ram is full, the group goes to a run
+                                if (state->spill == nullptr) {
+                                    state->spill = state->spills.create();
+                                }
+                                counted_fwrite(state->group, sizeof *state->group, filled, state->spill->file);
+                                filled = 0;
+                            }
+                            state->group[filled++] = state->ahead;
+                            state->group_size++;
+                            state->ahead_valid = state->right(state->ahead);
+                        }
+                        if (state->spill != nullptr) {
+                            counted_fwrite(state->group, sizeof *state->group, filled, state->spill->file);
+                            state->spills.put(state->spill);
+                            state->spill = state->spills.get();
+                        }
+                        state->block_begin = 0;
+                        state->block_len = filled;
+                        state->group_key = key;
+                    }
+                    if (state->group_size == 0) {
+                        if (state->matcher_func(state->l, nullptr, res)) {
+                            return true;
+                        }
+                        continue;
+                    }
+                    if (state->spill != nullptr) { // rewind, the blocks are read as l is joined
+                        state->spill->seek(0);
+                        state->block_begin = 0;
+                        state->block_len = 0;
+                    }
+                    state->pos = 0;
+                }
+                if (state->pos == state->block_begin + state->block_len) {
+                    state->block_begin = state->pos;
+                    state->block_len = counted_fread(
+                            state->group, sizeof *state->group,
+                            std::min(state->capacity, state->group_size - state->pos), state->spill->file);
+                }
+                const right_src_t &r = state->group[state->pos++ - state->block_begin];
+                if (state->pos == state->group_size) {
+                    state->pos = SIZE_MAX;
+                }
+                if (state->matcher_func(state->l, &r, res)) {
+                    return true;
+                }
+            }
+        };
+    }
+
+    // the right side is a hash table in memory, so left records may come in any order and neither side is sorted
+    template<typename left_key_T, typename right_key_T>
+    static source_t<target_t> hash_join(
+            source_t<left_src_t> left,
+            const hash_table_t<right_src_t, right_key_T> *right,
+            matcher_func_t matcher_func) {
+        typedef hash_table_t<right_src_t, right_key_T> table_t;
+        struct state_t {
+            source_t<left_src_t> left;
+            const table_t *right;
+            matcher_func_t matcher_func;
+            left_src_t l;
+            size_t slot; // next slot to match l against, npos: pull the next l
+            uint64_t joined;
+        };
+        auto state = std::make_shared<state_t>();
+
+        state->left = left;
+        state->right = right;
+        state->matcher_func = matcher_func;
+        state->slot = table_t::npos;
+        state->joined = 0;
+
+        return [state](target_t &res) {
+            const table_t &table = *state->right;
+
+            while (true) {
+                if (state->slot == table_t::npos) {
+                    if (!state->left(state->l)) {
+                        io_stats_t::instance().records_joined += state->joined;
+                        state->joined = 0;
+                        return false;
+                    }
+                    state->joined++;
+                    auto key = left_key_T::key(state->l);
+
+                    state->slot = table.find(key, table.home(key));
+                    if (state->slot == table_t::npos) {
+                        if (state->matcher_func(state->l, nullptr, res)) {
+                            return true;
+                        }
+                        continue;
+                    }
+                }
+                size_t slot = state->slot;
+                state->slot = table.find(left_key_T::key(state->l), table.next(slot));
+                if (state->matcher_func(state->l, &table.slots[slot], res)) {
+                    return true;
+                }
+            }
+        };
+    }
+
+    void join(
+            const char *left_name,
+            const char *right_name,
+            const char *result_name,
+            joiner_func_t joiner_func) {
+        FILE *left = fopen(left_name, "rb");
+        FILE *right = fopen(right_name, "rb");
+        FILE *result = fopen(result_name, "wb");
+
+        setvbuf(left, nullptr, _IONBF, 0);
+        setvbuf(right, nullptr, _IONBF, 0);
+        setvbuf(result, nullptr, _IONBF, 0);
+
+        left_join(left, right, result, joiner_func);
 
         fclose(left);
         fclose(right);
         fclose(result);
     }
 
-    ~joiner_t() {
-        if (self_alloc) {
-            delete[] ram;
+    ~joiner_t() {
+        if (self_alloc) {
+            delete[] ram;
+        }
+    }
+};
+
+template<typename src_T, typename target_T>
+struct mapper_t {
+
+    typedef std::function<bool(const src_T &, target_T &)> mapper_func_t;
+    typedef std::function<bool(const src_T &)> filter_predicate_t;
+
+    char *ram;
+    size_t ram_size;
+    bool write_output_size = true;
+    bool mapped_io = DEFAULT_MAPPED_IO;
+    bool packed_io = false; // target is stored with record_codec_t, the source tells by its header
+
+    mapper_t(char *ram, size_t ram_size) :
+            ram(ram),
+            ram_size(ram_size) {}
+
+    static bool identity(const src_T &src, target_T &target) {
+        target = src;
+        return true;
+    }
+
+    // maps and filters records inline as they are pulled
+    static source_t<target_T> map(source_t<src_T> source, mapper_func_t mapper_func) {
+        auto mapped = std::make_shared<uint64_t>(0);
+
+        return [source, mapper_func, mapped](target_T &target) {
+            src_T src{};
+
+            while (source(src)) {
+                ++*mapped;
+                if (mapper_func(src, target)) {
+                    return true;
+                }
+            }
+            io_stats_t::instance().records_mapped += *mapped; // counted once, off the hot path
+            *mapped = 0;
+            return false;
+        };
+    }
+
+    elements_size_t map(
+            const char *src_name,
+            const char *target_name,
+            mapper_func_t mapper_func = identity) {
+        FILE *src = fopen(src_name, "rb");
+        FILE *target = fopen(target_name, "wb");
+
+        setvbuf(src, nullptr, _IONBF, 0);
+        setvbuf(target, nullptr, _IONBF, 0);
+        auto cnt = map(src, target, mapper_func);
+
+        fclose(src);
+        fclose(target);
+        return cnt;
+    }
+
+    elements_size_t map(
+            FILE *src,
+            FILE *target,
+            mapper_func_t mapper_func) {
+        elements_size_t size = 0;
+        elements_size_t result_size = 0;
+        target_T target_val{};
+
+        size_t src_block_size = ram_size / (sizeof(src_T) + sizeof(target_T));
+        size_t target_block_size = (ram_size - src_block_size * sizeof(src_T)) / sizeof(target_T);
+
+        assert(src_block_size > 0);
+        assert(target_block_size > 0);
+
+        fread(&size, sizeof size, 1, src);
+        if (write_output_size) {
+            fwrite(&size, sizeof size, 1, target);
+        }
+        bool packed = (size & PACKED_FILE) != 0;
+        size &= ~PACKED_FILE;
+        block_reader_t<src_T> reader(src, (src_T *) ram, src_block_size, size, mapped_io, packed);
+        block_writer_t<target_T> writer(
+                target, (target_T *) (ram + src_block_size * sizeof(src_T)), target_block_size, packed_io);
+
+        const src_T *data;
+        for (size_t cnt; (cnt = reader.fetch(data)) != 0;) {
+            for (size_t i = 0; i < cnt; i++) {
+                if (!mapper_func(data[i], target_val)) {
+                    continue;
+                }
+                writer.put(target_val);
+                result_size++;
+            }
+        }
+        writer.flush();
+        io_stats_t::instance().records_mapped += size;
+        if (write_output_size) {
+            elements_size_t header = result_size | (packed_io ? PACKED_FILE : 0);
+            fseek(target, 0, SEEK_SET);
+            fwrite(&header, sizeof header, 1, target);
+        }
+
+        return result_size;
+    }
+};
+
+// writes value_T records to the positions of a permutation: placer gives every source record its position in
+// [0, size) and value, each position must be taken exactly once. Windows of positions that fit ram are filled
+// in place and written in order; when size exceeds one window the records are first spread over one spill
+// bucket per window, so the output costs about one read and one write of the data either way
+template<typename src_T, typename value_T>
+struct permuter_t {
+
+    typedef std::function<void(const src_T &, elements_size_t &, value_T &)> placer_func_t;
+
+    char *ram;
+    size_t ram_size;
+
+    permuter_t(char *ram, size_t ram_size) :
+            ram(ram),
+            ram_size(ram_size) {}
+
+    // false without pulling source when the bucket blocks would be smaller than DEFAULT_MIN_MERGE_BLOCK_SIZE
+    bool permute(
+            source_t<src_T> source,
+            elements_size_t size,
+            placer_func_t placer,
+            const char *name,
+            bool write_size = true) {
+        auto *window = (value_T *) ram;
+        size_t window_size = ram_size / sizeof(value_T);
+        elements_size_t pos = 0;
+        value_T value{};
+
+        if (size <= window_size) {
+            for (src_T src{}; source(src);) {
+                placer(src, pos, value);
+                window[pos] = value;
+            }
+            write_window(name, write_size, window, 0, static_cast<size_t>(size), size);
+            return true;
+        }
+
+        // a read block for the buckets is kept past the window
+        size_t read_block_size = std::max<size_t>(ram_size / 16 / sizeof(src_T), 1);
+        window_size = (ram_size - read_block_size * sizeof(src_T)) / sizeof(value_T);
+        auto buckets_cnt = static_cast<size_t>((size + window_size - 1) / window_size);
+        size_t block_size = ram_size / sizeof(src_T) / buckets_cnt;
+
+        if ((window_size == 0) || (block_size * sizeof(src_T) < DEFAULT_MIN_MERGE_BLOCK_SIZE)) {
+            return false;
+        }
+
+        spill_buckets_t<src_T> buckets((src_T *) ram, buckets_cnt, block_size);
+        for (src_T src{}; source(src);) {
+            placer(src, pos, value);
+            buckets.put(static_cast<size_t>(pos / window_size), src);
+        }
+        buckets.flush();
+
+        auto *read_block = (src_T *) (ram + window_size * sizeof(value_T));
+        for (size_t b = 0; b < buckets_cnt; b++) {
+            auto bucket = buckets.source(b, read_block, read_block_size);
+            elements_size_t begin = b * static_cast<elements_size_t>(window_size);
+
+            for (src_T src{}; bucket(src);) {
+                placer(src, pos, value);
+                window[pos - begin] = value;
+            }
+            buckets.release(b);
+            write_window(name, write_size && (b == 0), window, begin,
+                         static_cast<size_t>(std::min<elements_size_t>(window_size, size - begin)), size);
+        }
+        return true;
+    }
+
+private:
+    // writes window to positions [begin, begin + cnt) of name, the first window creates the file
+    static void write_window(
+            const char *name,
+            bool write_size,
+            const value_T *window,
+            elements_size_t begin,
+            size_t cnt,
+            elements_size_t size) {
+        FILE *file = fopen(name, (begin == 0) ? "wb" : "rb+");
+
+        setvbuf(file, nullptr, _IONBF, 0);
+        if (write_size) {
+            fwrite(&size, sizeof size, 1, file);
+        }
+        fseek(file, 0, SEEK_END);
+        counted_fwrite(window, sizeof *window, cnt, file);
+        fclose(file);
+    }
+};
+
+template<typename element_T, size_t idx>
+static int cmp_by(const void *l, const void *r) {
+    auto *lhs = (element_T *) l;
+    auto *rhs = (element_T *) r;
+
+    if (lhs[idx] < rhs[idx]) {
+        return -1;
+    } else if (lhs[idx] > rhs[idx]) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+// plain key extractor, lets merger_t pick radix sort for run formation
+template<typename element_T, size_t idx>
+struct key_by {
+    typedef element_T key_t;
+
+    template<typename tuple_T>
+    static key_t key(const tuple_T &t) {
+        return t.elem[idx];
+    }
+
+    static int cmp(const void *l, const void *r) {
+        return cmp_by<element_T, idx>(l, r);
+    }
+};
+
+// in-memory list ranking over <i, index of n(i), w(i)> nodes with a sparse ruling set:
+// every RULER_SPACING-th node heads a sublist, sublists are walked in parallel twice
+// (totals, then ranks) around one serial prefix sum over rulers; O(n) work
+template<typename id_T>
+struct list_ranker_t {
+    typedef tuple<id_T, 3> node_t;
+
+    struct ruler_t {
+        id_T next;
+        id_T total;
+        id_T prefix;
+    };
+
+    node_t *nodes;
+    ruler_t *rulers;
+    size_t size;
+    size_t threads;
+
+    list_ranker_t(void *ram, size_t size, size_t threads) :
+            nodes((node_t *) ram),
+            rulers((ruler_t *) (nodes + size)),
+            size(size),
+            threads(threads) {}
+
+    // nodes that fit into ram_size bytes together with their rulers
+    static size_t capacity(size_t ram_size) {
+        if (ram_size < sizeof(ruler_t)) {
+            return 0;
+        }
+        return (ram_size - sizeof(ruler_t)) * RULER_SPACING / (sizeof(node_t) * RULER_SPACING + sizeof(ruler_t));
+    }
+
+    static bool is_ruler(id_T node) {
+        return (node % RULER_SPACING) == 0;
+    }
+
+    // replaces w(i) with r(i), node 0 gets rank 0
+    void rank() {
+        size_t rulers_cnt = (size + RULER_SPACING - 1) / RULER_SPACING;
+        size_t workers = std::max<size_t>(std::min(threads, rulers_cnt), 1);
+
+        parallel_for(workers, [&](size_t t) {
+            for (size_t r = t; r < rulers_cnt; r += workers) {
+                const node_t &head = nodes[r * RULER_SPACING];
+                id_T total = head.elem[2];
+                id_T node = head.elem[1];
+
+                for (; !is_ruler(node); node = nodes[node].elem[1]) {
+                    total += nodes[node].elem[2];
+                }
+                rulers[r].next = node / RULER_SPACING;
+                rulers[r].total = total;
+            }
+        });
+
+        id_T prefix = 0;
+        for (size_t i = 0, r = 0; i < rulers_cnt; i++, r = rulers[r].next) {
+            rulers[r].prefix = prefix;
+            prefix += rulers[r].total;
+        }
+
+        parallel_for(workers, [&](size_t t) {
+            for (size_t r = t; r < rulers_cnt; r += workers) {
+                id_T rank = rulers[r].prefix;
+                auto node = static_cast<id_T>(r * RULER_SPACING);
+
+                do {
+                    id_T weight = nodes[node].elem[2];
+                    nodes[node].elem[2] = rank;
+                    rank += weight;
+                    node = nodes[node].elem[1];
+                } while (!is_ruler(node));
+            }
+        });
+    }
+};
+
+// a shard worker's own copy of the intermediate, see shards_t
+static const char *const format_name(const char *pattern, uint32_t id) {
+    static char buf[MAX_PATH];
+
+    snprintf(buf, sizeof buf, pattern, id);
+    snprintf(buf, sizeof buf, "%s", shards_t::instance().local(buf).c_str());
+    return buf;
+}
+
+// random priority of node i, fixed for one contraction iteration by seed;
+// splitmix64 is a bijection, so distinct nodes never tie
+static uint64_t priority(uint64_t seed, uint64_t i) {
+    uint64_t x = seed + i * 0x9e3779b97f4a7c15ull;
+
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// d(x): whether x is spliced out in this iteration. Depends on x, n(x) and n(n(x)) only,
+// so the records of x and of p(x) agree on it; removed nodes are never adjacent
+static inline bool removed(uint64_t seed, uint64_t x, uint64_t nx, uint64_t nnx) {
+#if DEFAULT_LOCAL_MINIMA_CONTRACTION
+    // n(x) is a local minimum: removes 1/3 of the nodes on average
+    uint64_t p = priority(seed, nx);
+    return p < priority(seed, x) && p < priority(seed, nnx);
+#else
+    // f(x) && !f(n(x)): removes 1/4 of the nodes on average
+    (void) nnx;
+    return (priority(seed, x) & 1) && !(priority(seed, nx) & 1);
+#endif
+}
+
+// what each stage of the run cost, from io_stats_t deltas and clocks; written at exit to REPORT_NAME, another
+// file given by --report= (or EXT_REPORT), or nowhere if that is empty
+struct run_report_t {
+    struct counters_t {
+        uint64_t wall_ns;
+        uint64_t cpu_ns; // all threads
+        uint64_t io_wait_ns;
+        uint64_t bytes_read;
+        uint64_t bytes_written;
+        uint64_t runs;
+        uint64_t merge_passes;
+        uint64_t records_joined;
+        uint64_t records_mapped;
+
+        static counters_t now() {
+            const io_stats_t &stats = io_stats_t::instance();
+
+            return counters_t{
+                    io_stats_t::now_ns(),
+                    static_cast<uint64_t>(double(std::clock()) * 1e9 / CLOCKS_PER_SEC),
+                    stats.io_wait_ns, stats.bytes_read, stats.bytes_written,
+                    stats.runs, stats.merge_passes, stats.records_joined, stats.records_mapped};
+        }
+
+        counters_t operator-(const counters_t &o) const {
+            return counters_t{
+                    wall_ns - o.wall_ns, cpu_ns - o.cpu_ns, io_wait_ns - o.io_wait_ns,
+                    bytes_read - o.bytes_read, bytes_written - o.bytes_written, runs - o.runs,
+                    merge_passes - o.merge_passes, records_joined - o.records_joined,
+                    records_mapped - o.records_mapped};
+        }
+
+        void print(FILE *out) const {
+            fprintf(out, "\"wall_s\": %.6f, \"cpu_s\": %.6f, \"io_wait_s\": %.6f, "
+                         "\"bytes_read\": %llu, \"bytes_written\": %llu, \"runs\": %llu, "
+                         "\"merge_passes\": %llu, \"records_joined\": %llu, \"records_mapped\": %llu",
+                    wall_ns / 1e9, cpu_ns / 1e9, io_wait_ns / 1e9,
+                    (unsigned long long) bytes_read, (unsigned long long) bytes_written,
+                    (unsigned long long) runs, (unsigned long long) merge_passes,
+                    (unsigned long long) records_joined, (unsigned long long) records_mapped);
+        }
+    };
+
+    struct stage_t {
+        const char *name;
+        uint32_t level;
+        counters_t cost;
+
+        void print(FILE *out) const {
+            fprintf(out, "{\"stage\": \"%s\", \"level\": %u, ", name, level);
+            cost.print(out);
+            fprintf(out, "}");
+        }
+    };
+
+    // one contraction iteration of the list
+    struct level_t {
+        uint32_t level;
+        uint64_t size_before;
+        uint64_t size_after;
+
+        void print(FILE *out) const {
+            fprintf(out, "{\"level\": %u, \"size_before\": %llu, \"size_after\": %llu, \"removed\": %.4f}",
+                    level, (unsigned long long) size_before, (unsigned long long) size_after,
+                    size_before ? double(size_before - size_after) / size_before : 0.0);
+        }
+    };
+
+    counters_t start = counters_t::now();
+    bool progress = DEFAULT_PROGRESS;
+    std::string name = REPORT_NAME;
+    size_t memory_size = 0;
+    double seek_bytes = 0;
+    size_t id_bits = 0;
+    uint64_t list_size = 0;
+    std::vector<stage_t> stages;
+    std::vector<level_t> levels;
+
+    static run_report_t &instance() {
+        static run_report_t report;
+        return report;
+    }
+
+    // EXT_PROGRESS and EXT_REPORT from the environment, then --progress and --report= arguments
+    void configure(int argc, char const *argv[]) {
+        const char *env = getenv("EXT_PROGRESS");
+
+        progress = progress || ((env != nullptr) && *env && strcmp(env, "0"));
+        if ((env = getenv("EXT_REPORT")) != nullptr) {
+            name = env;
+        }
+        for (int i = 1; i < argc; i++) {
+            if (!strcmp(argv[i], "--progress")) {
+                progress = true;
+            } else if (!strncmp(argv[i], "--report=", 9)) {
+                name = argv[i] + 9;
+            }
+        }
+    }
+
+    void add_stage(const char *name, uint32_t level, const counters_t &cost) {
+        stages.push_back(stage_t{name, level, cost});
+        if (progress) {
+            stages.back().print(stderr);
+            fprintf(stderr, "\n");
+        }
+    }
+
+    void add_level(uint32_t level, uint64_t size_before, uint64_t size_after) {
+        levels.push_back(level_t{level, size_before, size_after});
+        if (progress) {
+            levels.back().print(stderr);
+            fprintf(stderr, "\n");
+        }
+    }
+
+    void write() const {
+        FILE *out = name.empty() ? nullptr : fopen(name.c_str(), "w");
+
+        if (out == nullptr) {
+            return;
+        }
+        fprintf(out, "{\n  \"memory_size\": %llu,\n  \"seek_bytes\": %.0f,\n  \"id_bits\": %llu,\n"
+                     "  \"list_size\": %llu,\n  \"total\": {",
+                (unsigned long long) memory_size, seek_bytes, (unsigned long long) id_bits,
+                (unsigned long long) list_size);
+        (counters_t::now() - start).print(out);
+        fprintf(out, "},\n  \"levels\": [");
+        for (size_t i = 0; i < levels.size(); i++) {
+            fprintf(out, i ? ",\n    " : "\n    ");
+            levels[i].print(out);
         }
+        fprintf(out, "\n  ],\n  \"stages\": [");
+        for (size_t i = 0; i < stages.size(); i++) {
+            fprintf(out, i ? ",\n    " : "\n    ");
+            stages[i].print(out);
+        }
+        fprintf(out, "\n  ]\n}\n");
+        fclose(out);
     }
 };
 
-template<typename src_T, typename target_T>
-struct mapper_t {
+// reports what happened between its construction and destruction as one stage
+struct stage_scope_t {
+    const char *name;
+    uint32_t level;
+    run_report_t::counters_t start;
 
-    typedef std::function<bool(const src_T &, target_T &)> mapper_func_t;
-    typedef std::function<bool(const src_T &)> filter_predicate_t;
+    stage_scope_t(const char *name, uint32_t level) :
+            name(name),
+            level(level),
+            start(run_report_t::counters_t::now()) {}
 
-    char *ram;
-    size_t ram_size;
-    bool write_output_size = true;
+    ~stage_scope_t() {
+        run_report_t::instance().add_stage(name, level, run_report_t::counters_t::now() - start);
+    }
+};
 
-    mapper_t(char *ram, size_t ram_size) :
-            ram(ram),
-            ram_size(ram_size) {}
+// how far a run got, in CHECKPOINT_NAME: with --checkpoint (or EXT_CHECKPOINT=1) rank_list records each level
+// once its files are synced, and a rerun with --resume (or EXT_RESUME=1, which also keeps checkpointing) over the
+// same input resumes after it. The input is the same if its size, inode, mtime and ctime (to the nanosecond) and
+// a hash of sampled blocks of its content all match. Without either nothing is synced or recorded.
+// Files the checkpoint no longer refers to are deleted
+struct checkpoint_t {
+    static const size_t sample_block = 4096;
+    static const size_t samples = 64;
 
-    static bool identity(const src_T &src, target_T &target) {
-        target = src;
-        return true;
+    uint64_t input_bytes = 0;
+    uint64_t input_inode = 0;
+    int64_t input_mtime_ns = 0;
+    int64_t input_ctime_ns = 0;
+    uint64_t input_hash = 0;
+    uint64_t list_size = 0;
+    uint32_t id_bits = 0;
+    uint32_t levels = 0; // contraction levels done: seven.0 .. seven.(levels - 1) and weighted.levels exist
+    bool contracted = false; // weighted.levels is left for the base case
+    elements_size_t weighted_size = 0;
+    int64_t ranked = -1; // ranked.ranked is restored, so are all levels above it; -1 before the base case
+    uint64_t min_id = 0;
+    uint64_t max_id = 0;
+    std::vector<elements_size_t> seven_sizes;
+
+    static bool &enabled() {
+        static bool enabled = DEFAULT_CHECKPOINT;
+        return enabled;
     }
 
-    elements_size_t map(
-            const char *src_name,
-            const char *target_name,
-            mapper_func_t mapper_func = identity) {
-        FILE *src = fopen(src_name, "rb");
-        FILE *target = fopen(target_name, "wb");
+    static bool &resume() {
+        static bool resume = false;
+        return resume;
+    }
 
-        size_t src_buf_size = ram_size / (sizeof(src_T) + sizeof(target_T)) * sizeof(src_T);
-        size_t target_buf_size = ram_size - src_buf_size;
+    static void configure(int argc, char const *argv[]) {
+        auto flag = [](const char *env) {
+            return (env != nullptr) && *env && strcmp(env, "0");
+        };
 
-        assert(src_buf_size > 0);
-        assert(target_buf_size > 0);
-        assert((src_buf_size + target_buf_size) <= ram_size);
+        enabled() = enabled() || flag(getenv("EXT_CHECKPOINT"));
+        resume() = flag(getenv("EXT_RESUME"));
+        for (int i = 1; i < argc; i++) {
+            if (!strcmp(argv[i], "--checkpoint")) {
+                enabled() = true;
+            } else if (!strcmp(argv[i], "--resume")) {
+                resume() = true;
+            }
+        }
+        enabled() = enabled() || resume();
+    }
 
-        setvbuf(src, ram, _IOFBF, src_buf_size);
-        setvbuf(target, ram + src_buf_size, _IOFBF, target_buf_size);
-        auto cnt = map(src, target, mapper_func);
+    // the checkpoint an earlier run left for this input if resuming, otherwise a fresh one
+    static checkpoint_t load(const char *input, uint32_t id_bits, uint64_t list_size) {
+        checkpoint_t fresh;
+        struct stat st{};
 
-        fclose(src);
-        fclose(target);
-        return cnt;
+        if (enabled() && (stat(input, &st) == 0)) {
+            fresh.input_bytes = static_cast<uint64_t>(st.st_size);
+            fresh.input_inode = static_cast<uint64_t>(st.st_ino);
+            fresh.input_mtime_ns = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+            fresh.input_ctime_ns = int64_t(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec;
+            fresh.input_hash = content_hash(input, fresh.input_bytes);
+        }
+        fresh.list_size = list_size;
+        fresh.id_bits = id_bits;
+        fresh.weighted_size = list_size;
+
+        FILE *file = resume() ? fopen(CHECKPOINT_NAME, "r") : nullptr;
+        if (file == nullptr) {
+            return fresh;
+        }
+        checkpoint_t saved;
+        unsigned long long input_bytes = 0, input_inode = 0, input_hash = 0;
+        unsigned long long size = 0, weighted_size = 0, min_id = 0, max_id = 0;
+        long long input_mtime_ns = 0, input_ctime_ns = 0, ranked = 0;
+        unsigned bits = 0, levels = 0, contracted = 0;
+        bool valid = fscanf(file, "input %llu %llu %lld %lld %llx\nlist %llu %u\nlevels %u %u %llu\nranked %lld\n"
+                                  "ids %llu %llu\n",
+                            &input_bytes, &input_inode, &input_mtime_ns, &input_ctime_ns, &input_hash, &size, &bits,
+                            &levels, &contracted, &weighted_size, &ranked, &min_id, &max_id) == 13;
+
+        saved.input_bytes = input_bytes;
+        saved.input_inode = input_inode;
+        saved.input_mtime_ns = input_mtime_ns;
+        saved.input_ctime_ns = input_ctime_ns;
+        saved.input_hash = input_hash;
+        saved.list_size = size;
+        saved.id_bits = bits;
+        saved.levels = levels;
+        saved.contracted = contracted != 0;
+        saved.weighted_size = weighted_size;
+        saved.ranked = ranked;
+        saved.min_id = min_id;
+        saved.max_id = max_id;
+        for (uint32_t i = 0; valid && (i < levels); i++) {
+            unsigned long long seven_size = 0;
+            valid = fscanf(file, "seven %llu\n", &seven_size) == 1;
+            saved.seven_sizes.push_back(seven_size);
+        }
+        fclose(file);
+
+        if (!valid || (saved.input_bytes != fresh.input_bytes) || (saved.input_inode != fresh.input_inode)
+            || (saved.input_mtime_ns != fresh.input_mtime_ns) || (saved.input_ctime_ns != fresh.input_ctime_ns)
+            || (saved.input_hash != fresh.input_hash) || (saved.list_size != list_size) || (saved.id_bits != id_bits)) {
+            return fresh;
+        }
+        return saved;
     }
 
-    elements_size_t map(
-            FILE *src,
-            FILE *target,
-            mapper_func_t mapper_func) {
-        elements_size_t size = 0;
-        elements_size_t result_size = 0;
-        src_T src_val{};
-        target_T target_val{};
+    // replaces CHECKPOINT_NAME in one rename, after every file it names was made durable
+    void save() const {
+        if (!enabled()) {
+            return;
+        }
+        char name[MAX_PATH + 8]{};
+        snprintf(name, sizeof name, "%s.tmp", CHECKPOINT_NAME);
 
-        fread(&size, sizeof size, 1, src);
-        if (write_output_size) {
-            fwrite(&size, sizeof size, 1, target);
+        FILE *file = fopen(name, "w");
+        if (file == nullptr) {
+            return;
         }
-        for (elements_size_t i = 0; i < size; i++) {
-            fread(&src_val, sizeof src_val, 1, src);
-            if(!mapper_func(src_val, target_val)) {
-                continue;
-            }
-            fwrite(&target_val, sizeof target_val, 1, target);
-            result_size++;
+        fprintf(file, "input %llu %llu %lld %lld %llx\nlist %llu %u\nlevels %u %u %llu\nranked %lld\nids %llu %llu\n",
+                (unsigned long long) input_bytes, (unsigned long long) input_inode, (long long) input_mtime_ns,
+                (long long) input_ctime_ns, (unsigned long long) input_hash, (unsigned long long) list_size, id_bits,
+                levels, contracted ? 1u : 0u, (unsigned long long) weighted_size, (long long) ranked,
+                (unsigned long long) min_id, (unsigned long long) max_id);
+        for (elements_size_t seven_size : seven_sizes) {
+            fprintf(file, "seven %llu\n", (unsigned long long) seven_size);
         }
-        if (write_output_size) {
-            fseek(target, 0, SEEK_SET);
-            fwrite(&result_size, sizeof result_size, 1, target);
+        fflush(file);
+        fsync(fileno(file));
+        fclose(file);
+        rename(name, CHECKPOINT_NAME);
+    }
+
+    static void sync(const char *name) {
+        if (!enabled()) {
+            return;
         }
+        int fd = open(name, O_RDONLY);
 
-        return result_size;
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+    }
+
+    static void clear() {
+        remove(CHECKPOINT_NAME);
+    }
+
+private:
+    // hash of the first and last blocks of name and of samples blocks spread evenly between them
+    static uint64_t content_hash(const char *name, uint64_t bytes) {
+        int fd = open(name, O_RDONLY);
+        uint64_t hash = bytes;
+
+        if (fd < 0) {
+            return hash;
+        }
+        auto *buf = new uint8_t[sample_block];
+        for (size_t i = 0; i <= samples; i++) {
+            uint64_t offset = (bytes > sample_block) ? (bytes - sample_block) / samples * i : 0;
+            ssize_t read = pread(fd, buf, sample_block, static_cast<off_t>(offset));
+
+            for (ssize_t k = 0; k < read; k++) {
+                hash = (hash ^ buf[k]) * 0x100000001b3ull; // FNV-1a
+            }
+            if (bytes <= sample_block) {
+                break;
+            }
+        }
+        delete[] buf;
+        close(fd);
+        return priority(hash, bytes);
     }
 };
 
-template<typename element_T, size_t idx>
-static int cmp_by(const void *l, const void *r) {
-    auto *lhs = (element_T *) l;
-    auto *rhs = (element_T *) r;
+// pipelined stages of the ranking share ram: up to four file streams in the first half, one sorter in the second
+struct ram_layout_t {
+    char *ram;
+    size_t stream_ram_size;
+    char *sort_ram;
+    size_t sort_ram_size;
 
-    if (lhs[idx] < rhs[idx]) {
-        return -1;
-    } else if (lhs[idx] > rhs[idx]) {
-        return 1;
-    } else {
-        return 0;
+    ram_layout_t(char *ram, size_t ram_size) :
+            ram(ram),
+            stream_ram_size(ram_size / 8 / 64 * 64),
+            sort_ram(ram + ram_size / 2),
+            sort_ram_size(ram_size - ram_size / 2) {}
+
+    char *stream_ram(size_t i) const {
+        return ram + i * stream_ram_size;
     }
+};
+
+// the in-memory base case keeps a small tail of ram for streaming its input and output
+static size_t base_case_io_ram_size(size_t ram_size) {
+    return std::max<size_t>(ram_size / 32 / 64 * 64, 64);
 }
 
-typedef tuple<uint32_t, 2> pair;
-typedef tuple<uint32_t, 3> three;
-typedef tuple<uint32_t, 4> four;
-typedef tuple<uint32_t, 6> six;
-typedef tuple<uint32_t, 7> seven;
-typedef tuple<uint32_t, 8> eight;
-typedef tuple<uint32_t, 9> nine;
+// ranks the last level's <i, n(i), w(i)> of weighted in ram, writes <i, r(i)> sorted by i to ranked_name
+template<typename id_T>
+static void rank_base_case(source_t<tuple<id_T, 3>> weighted, const char *ranked_name, char *ram, size_t ram_size) {
+    typedef tuple<id_T, 2> pair;
+    typedef tuple<id_T, 3> three;
+    typedef mapper_t<three, pair> successor_indexer;
 
-static const char *const format_name(const char *pattern, uint32_t id) {
-    static char buf[MAX_PATH];
+    const ram_layout_t layout(ram, ram_size);
+    size_t io_size = base_case_io_ram_size(ram_size);
+    char *io_ram = ram + ram_size - io_size;
+    auto *nodes = (three *) ram; // i, index of n(i), w(i) -> r(i); sorted by i
+    auto by_id_sorter = merger_t<three>(layout.sort_ram, layout.sort_ram_size);
+    auto by_successor_sorter = merger_t<pair>(layout.sort_ram, layout.sort_ram_size);
+    id_T index = 0;
 
-    sprintf(buf, pattern, id);
-    return buf;
-}
+    by_id_sorter.sort(weighted, JOIN_LEFT_NAME, key_by<id_T, 0>());
+    by_successor_sorter.sort(
+            successor_indexer::map(
+                    file_source<three>(JOIN_LEFT_NAME, layout.stream_ram(0), layout.stream_ram_size),
+                    [&index](const three &src, pair &target) {
+                        target.elem[0] = src.elem[1]; // n(i)
+                        target.elem[1] = index++; // index of i
+                        return true;
+                    }),
+            JOIN_RIGHT_NAME,
+            key_by<id_T, 0>()); // k-th n(i) is the k-th smallest i
 
-int main() {
-    const char *input = DEFAULT_INPUT_PATTERN;
-    const char *output = DEFAULT_OUTPUT;
-    size_t ram_size = DEFAULT_MEMORY_SIZE;
-    auto *ram = new char[ram_size];
+    elements_size_t size = 0;
+    FILE *weighted_file = fopen(JOIN_LEFT_NAME, "rb");
+    fread(&size, sizeof size, 1, weighted_file);
+    counted_fread(nodes, sizeof *nodes, size, weighted_file);
+    fclose(weighted_file);
+
+    auto successors = file_source<pair>(JOIN_RIGHT_NAME, io_ram, io_size);
+    pair successor{};
+    for (id_T k = 0; successors(successor); k++) {
+        nodes[successor.elem[1]].elem[1] = k;
+    }
 
-    auto weight_appender = mapper_t<pair, three>(ram, ram_size);
+    list_ranker_t<id_T>(ram, size, default_threads()).rank();
 
-    uint32_t iteration = 0;
-    weight_appender.map(
-            input,
-            format_name(WEIGHTED_NAME_PATTERN, iteration),
-            [](const pair &src, three &target) {
-                target.elem[0] = src.elem[0];   // i
-                target.elem[1] = src.elem[1];   // n(i)
-                target.elem[2] = 1;             // w(i)
+    size_t k = 0;
+    write_to<pair>(
+            [nodes, size, &k](pair &target) {
+                if (k == size) {
+                    return false;
+                }
+                target.elem[0] = nodes[k].elem[0]; // i
+                target.elem[1] = nodes[k].elem[2]; // r(i)
+                k++;
                 return true;
-            });
+            },
+            ranked_name, io_ram, io_size); // sorted by i
+
+    remove(JOIN_LEFT_NAME);
+    remove(JOIN_RIGHT_NAME);
+}
+
+// the coordinator's part of a sharded ranking, see shards_t: the workers contract and restore the levels, the
+// base case ranks here what all of them left of the last level. ranked.0 is the workers' ranked.0 in the order
+// of their id ranges, so sorted by i
+template<typename id_T, typename input_id_T>
+static void coordinate_shards(
+        const char *input,
+        long input_offset,
+        elements_size_t input_size,
+        char *ram,
+        size_t ram_size) {
+    typedef tuple<id_T, 2> pair;
+    typedef tuple<id_T, 3> three;
+
+    shards_t &shards = shards_t::instance();
+    shards_t::job_t &job = shards.shared->job;
+    const ram_layout_t layout(ram, ram_size);
+    run_report_t &report = run_report_t::instance();
+    uint32_t levels = 0;
+    elements_size_t size = 0;
+
+    snprintf(job.input, sizeof job.input, "%s", input);
+    job.input_offset = input_offset;
+    job.input_size = input_size;
+    job.id_bits = sizeof(id_T) * 8;
+    job.input_id_bits = sizeof(input_id_T) * 8;
+    job.base_case_size = list_ranker_t<id_T>::capacity(ram_size - base_case_io_ram_size(ram_size));
+    job.quit = false;
+    {
+        stage_scope_t stage("sharded_contract", 0);
+
+        shards.wait_all(); // the workers take the job
+        shards.wait_all(); // and contract
+        shards.receive_io();
+        levels = shards.shared->levels;
+    }
+    for (uint32_t level = 0; level < std::min(levels, uint32_t(shards_t::max_levels)); level++) {
+        report.add_level(level, shards.shared->level_sizes[level][0], shards.shared->level_sizes[level][1]);
+    }
+
+    const std::string ranked_name = format_name(RANKED_NAME_PATTERN, levels);
+    {
+        stage_scope_t stage("base_case", levels);
+        const std::string weighted_name = format_name(WEIGHTED_NAME_PATTERN, levels);
+
+        rank_base_case<id_T>(
+                concatenated<three>(
+                        [weighted_name](size_t k) { return shards_t::shard_name(weighted_name.c_str(), k); },
+                        shards.count, layout.stream_ram(0), layout.stream_ram_size, size),
+                ranked_name.c_str(), ram, ram_size);
+    }
+    {
+        stage_scope_t stage("sharded_restore", levels);
+        const std::string first_ranked_name = format_name(RANKED_NAME_PATTERN, 0);
+
+        shards.wait_all(); // the workers take their part of the ranks
+        shards.wait_all(); // and restore
+        shards.receive_io();
+        remove(ranked_name.c_str());
+        write_to<pair>(
+                concatenated<pair>(
+                        [first_ranked_name](size_t k) { return shards_t::shard_name(first_ranked_name.c_str(), k); },
+                        shards.count, layout.stream_ram(0), layout.stream_ram_size, size),
+                first_ranked_name.c_str(), layout.stream_ram(1), layout.stream_ram_size);
+    }
+}
+
+// ranks the list whose <i, n(i)> records of input_id_T start at input_offset in input on id_T ids, leaves
+// <i, r(i)> sorted by i in ranked.0; a rerun over the same origin resumes from the checkpoint. A shard worker
+// ranks the levels of its id range and leaves its part of ranked.0, see shards_t
+template<typename id_T, typename input_id_T = id_T>
+static void rank_nodes(
+        const char *input,
+        long input_offset,
+        elements_size_t input_size,
+        const char *origin,
+        char *ram,
+        size_t ram_size) {
+    typedef tuple<id_T, 2> pair;
+    typedef tuple<id_T, 3> three;
+    typedef tuple<id_T, 4> four;
+    typedef tuple<id_T, 7> seven;
+    typedef tuple<id_T, 5> five;
+
+    const ram_layout_t layout(ram, ram_size);
+    size_t base_case_io_size = base_case_io_ram_size(ram_size);
+    char *base_case_io_ram = ram + ram_size - base_case_io_size;
+    // intermediates only read back through file_source may be packed, ranked.N is read raw
+    const bool packed = DEFAULT_PACKED_IO;
+    run_report_t &report = run_report_t::instance();
+
+    report.memory_size = ram_size;
+    report.seek_bytes = cost_model_t::instance().seek_bytes;
+    report.id_bits = sizeof(id_T) * 8;
+    report.list_size = input_size;
+
+    shards_t &shards = shards_t::instance();
+    if (shards.coordinating()) {
+        coordinate_shards<id_T, input_id_T>(input, input_offset, input_size, ram, ram_size);
+        return;
+    }
 
-    std::random_device rd{};
-    std::mt19937 mt(rd());
-//    std::mt19937 mt(0);
-    std::uniform_int_distribution<uint32_t> uid(0, 1);
+    typedef mapper_t<tuple<input_id_T, 2>, three> weight_appender;
+    typedef joiner_t<three, three, four> successor_joiner;
+    typedef joiner_t<four, four, seven> mega_seven_joiner;
+    typedef mapper_t<seven, three> list_reducer;
 
-    auto flagger = mapper_t<three, four>(ram, ram_size);
-    auto weighted_sorter = merger_t<four>(ram, ram_size);
-    auto joined_flagged_sorter = merger_t<six>(ram, ram_size);
-    auto flagged_joiner = joiner_t<four, four, six>(ram, ram_size);
-    auto mega_seven_joiner = joiner_t<six, six, seven>(ram, ram_size);
-    auto list_reducer = mapper_t<seven, three>(ram, ram_size);
+    auto weighted_sorter = merger_t<three>(layout.sort_ram, layout.sort_ram_size);
+    auto successor_sorter = merger_t<three>(layout.sort_ram, layout.sort_ram_size);
+    auto joined_successors_sorter = merger_t<four>(layout.sort_ram, layout.sort_ram_size);
 
+    successor_sorter.replacement_selection = DEFAULT_REPLACEMENT_SELECTION; // weighted are partly sorted by n(i)
+
+    const std::string join_left = shards.local(JOIN_LEFT_NAME);
+    const std::string join_right = shards.local(JOIN_RIGHT_NAME);
+    const std::string join_result = shards.local(JOIN_RESULT_NAME);
+    const char *const weighted_names[] = {join_left.c_str(), join_right.c_str()}; // by i and by n(i)
+
+    checkpoint_t checkpoint = checkpoint_t::load(origin, sizeof(id_T) * 8, input_size);
+    uint32_t iteration = checkpoint.levels;
     char weighted_name[MAX_PATH]{};
     char seven_name[MAX_PATH]{};
+    // ids of every level lie in the range of the input ids, so sorts by id can distribute on it
+    id_T min_id = (iteration > 0) ? static_cast<id_T>(checkpoint.min_id) : std::numeric_limits<id_T>::max();
+    id_T max_id = static_cast<id_T>(checkpoint.max_id);
+    std::vector<elements_size_t> &seven_sizes = checkpoint.seven_sizes;
+
+    if (shards.worker) {
+        // a worker reads its slice of the input; the id range is split once the range of all ids is known
+        typedef tuple<input_id_T, 2> input_pair;
+        elements_size_t begin = input_size / shards.count * shards.index + std::min<elements_size_t>(
+                shards.index, input_size % shards.count);
+        elements_size_t end = input_size / shards.count * (shards.index + 1) + std::min<elements_size_t>(
+                shards.index + 1, input_size % shards.count);
+        auto slice = file_source<input_pair>(
+                input, input_offset + static_cast<long>(begin * sizeof(input_pair)), end - begin,
+                layout.stream_ram(0), layout.stream_ram_size);
+
+        for (input_pair src{}; slice(src);) {
+            min_id = std::min<id_T>(min_id, src.elem[0]);
+            max_id = std::max<id_T>(max_id, src.elem[0]);
+        }
+        min_id = static_cast<id_T>(shards.reduce(min_id, [](uint64_t a, uint64_t b) { return std::min(a, b); }));
+        max_id = static_cast<id_T>(shards.reduce(max_id, [](uint64_t a, uint64_t b) { return std::max(a, b); }));
+        shards.partition(min_id, max_id);
+        input_offset += static_cast<long>(begin * sizeof(input_pair));
+        input_size = end - begin;
+    }
+    // sorts by id distribute on the ids this process keeps; the base case of a worker runs in the coordinator
+    auto first_id = [&]() { return shards.worker ? static_cast<id_T>(shards.first_id(shards.index)) : min_id; };
+    auto last_id = [&]() { return shards.worker ? static_cast<id_T>(shards.last_id(shards.index)) : max_id; };
+    const elements_size_t base_case_size = shards.worker ? shards.shared->job.base_case_size
+                                                         : list_ranker_t<id_T>::capacity(ram_size - base_case_io_size);
 
+    if (iteration > 0) {
+        strcpy(weighted_name, format_name(WEIGHTED_NAME_PATTERN, iteration));
+    }
     // reduce source list, output: weighted(iteration), seven(iteration - 1)
-    while (true) {
-        flagger.map(format_name(WEIGHTED_NAME_PATTERN, iteration),
-                    JOIN_RESULT_NAME,
-                    [&uid, &mt](const three &src, four &target) {
-                        target.elem[0] = src.elem[0];                       // i
-                        target.elem[1] = src.elem[1];                       // n(i)
-                        target.elem[2] = src.elem[2];                       // w(i)
-                        target.elem[3] = static_cast<uint32_t>(uid(mt));    // f(i)
-                        return true;
-                    });
-        weighted_sorter.sort(JOIN_RESULT_NAME, JOIN_LEFT_NAME, cmp_by<uint32_t, 0>);
-        weighted_sorter.sort(JOIN_RESULT_NAME, JOIN_RIGHT_NAME, cmp_by<uint32_t, 1>);
-        flagged_joiner.join(JOIN_LEFT_NAME, JOIN_RIGHT_NAME, JOIN_RESULT_NAME,
-                            [](const four &left, const four &right, six &result) {
-                                result.elem[0] = right.elem[0]; // == i
-                                result.elem[1] = right.elem[1]; // == n(i) == left.elem[0]
-                                result.elem[2] = left.elem[1]; // == n(n(i)) <- is not used
-                                result.elem[3] = right.elem[2]; // == w(i)
-                                result.elem[4] = right.elem[3]; // == f(i)
-                                result.elem[5] = left.elem[3]; // == f(n(i))
-                                return true;
-                            }); // sorted by result.elem[1]
+    while (!checkpoint.contracted && (checkpoint.ranked < 0)) {
+        // d(i) is a function of node ids, so no flags are stored and reruns contract identically
+        uint64_t seed = priority(0x5eedull, iteration);
+        auto weighted = [&]() {
+            if (iteration == 0) {
+                return weight_appender::map(
+                        file_source<tuple<input_id_T, 2>>(input, input_offset, input_size, layout.stream_ram(0),
+                                                          layout.stream_ram_size),
+                        [&min_id, &max_id](const tuple<input_id_T, 2> &src, three &target) {
+                            min_id = std::min<id_T>(min_id, src.elem[0]);
+                            max_id = std::max<id_T>(max_id, src.elem[0]);
+                            target.elem[0] = src.elem[0];   // i
+                            target.elem[1] = src.elem[1];   // n(i)
+                            target.elem[2] = 1;             // w(i)
+                            return true;
+                        });
+            }
+            return file_source<three>(weighted_name, layout.stream_ram(0), layout.stream_ram_size);
+        };
+        {
+            stage_scope_t stage("split", iteration);
 
-        joined_flagged_sorter.sort(JOIN_RESULT_NAME, JOIN_LEFT_NAME, cmp_by<uint32_t, 0>);
+            if (shards.worker) {
+                // a record goes to the owner of i and to the owner of n(i), each sorts what it got
+                size_t half = layout.sort_ram_size / 2 / 64 * 64;
+                elements_size_t received = 0;
+                {
+                    shard_sender_t<three> by_id("left", layout.sort_ram, half);
+                    shard_sender_t<three> by_successor("right", layout.sort_ram + half, half);
+                    auto source = weighted();
 
-        strcpy(seven_name, format_name(SEVEN_NAME_PATTERN, iteration));
-        mega_seven_joiner.join(
-                JOIN_LEFT_NAME,
-                JOIN_RESULT_NAME,
-                seven_name,
-                [](const six &left, const six &right, seven &result) {
-                    result.elem[0] = right.elem[0]; // p(j)
-                    result.elem[1] = static_cast<uint32_t>(right.elem[4] && !right.elem[5]); // d(p(j)) = f(p(j)) && f(j)
-                    result.elem[2] = right.elem[3]; // w(p(j))
-                    result.elem[3] = right.elem[1]; //j = i
-                    result.elem[4] = left.elem[1]; // n(i)
-                    result.elem[5] = static_cast<uint32_t>(left.elem[4] && !left.elem[5]); // d(i) = f(i) && f(n(i))
-                    result.elem[6] = left.elem[3]; // w(i)
-                    return true;
+                    for (three src{}; source(src);) {
+                        by_id.put(shards.owner(src.elem[0]), src);
+                        by_successor.put(shards.owner(src.elem[1]), src);
+                    }
+                }
+                shards.wait_workers();
+                weighted_sorter.sort(
+                        shard_received<three>("left", layout.stream_ram(0), layout.stream_ram_size, received),
+                        join_left.c_str(), key_by<id_T, 0>());
+                successor_sorter.sort(
+                        shard_received<three>("right", layout.stream_ram(0), layout.stream_ram_size, received),
+                        join_right.c_str(), key_by<id_T, 1>());
+            } else if (successor_sorter.replacement_selection) {
+                weighted_sorter.sort(weighted(), join_left.c_str(), key_by<id_T, 0>());
+                successor_sorter.sort(weighted(), join_right.c_str(), key_by<id_T, 1>());
+            } else {
+                weighted_sorter.multi_sort(weighted(), weighted_names, key_by<id_T, 0>(), key_by<id_T, 1>());
+            }
+        }
+        stage_scope_t contract_stage("contract", iteration); // the rest of the iteration
+
+        elements_size_t successors_size = checkpoint.weighted_size;
+        source_t<four> successors = tee<four>(
+                successor_joiner::left_join(
+                        file_source<three>(join_left.c_str(), layout.stream_ram(0), layout.stream_ram_size),
+                        file_source<three>(join_right.c_str(), layout.stream_ram(1), layout.stream_ram_size),
+                        [](const three &left, const three &right, four &result) {
+                            result.elem[0] = right.elem[0]; // == i
+                            result.elem[1] = right.elem[1]; // == n(i) == left.elem[0]
+                            result.elem[2] = left.elem[1]; // == n(n(i))
+                            result.elem[3] = right.elem[2]; // == w(i)
+                            return true;
+                        }), // sorted by result.elem[1]
+                join_result.c_str(), layout.stream_ram(2), layout.stream_ram_size, packed);
+        if (shards.worker) {
+            // the owner of i takes it on
+            {
+                shard_sender_t<four> sender("successors", layout.sort_ram, layout.sort_ram_size);
+
+                for (four src{}; successors(src);) {
+                    sender.put(shards.owner(src.elem[0]), src);
                 }
-        ); // sorted by result.elem[3]
+            }
+            shards.wait_workers();
+            successors = shard_received<four>(
+                    "successors", layout.stream_ram(3), layout.stream_ram_size, successors_size);
+        }
+        auto joined_successors = joined_successors_sorter.distributed(
+                successors, key_by<id_T, 0>(), first_id(), last_id(), successors_size);
 
+        strcpy(seven_name, format_name(SEVEN_NAME_PATTERN, iteration));
         strcpy(weighted_name, format_name(WEIGHTED_NAME_PATTERN, iteration + 1));
-        elements_size_t current_size = list_reducer.map(
-                seven_name,
-                weighted_name,
-                [](const seven &src, three &target) {
-                    if (!src.elem[1] && !src.elem[5]) { // !d(p(j)) && !d(j)
-                        target.elem[0] = src.elem[0]; // p(j)
-                        target.elem[1] = src.elem[3]; // j
-                        target.elem[2] = src.elem[2]; // w(p(j))
-                        return true;
-                    } else if (src.elem[5]) { // d(j)
-                        target.elem[0] = src.elem[0]; // p(j)
-                        target.elem[1] = src.elem[4]; // n(j)
-                        target.elem[2] = src.elem[2] + src.elem[6]; // w(p(j)) + w(j)
-                        return true;
-                    }
-                    return false;
-                }
+        elements_size_t previous_size = 0;
+        elements_size_t current_size = write_to<three>(
+                list_reducer::map(
+                        tee<seven, four>(
+                                mega_seven_joiner::left_join(
+                                        joined_successors,
+                                        file_source<four>(join_result.c_str(), layout.stream_ram(0),
+                                                          layout.stream_ram_size),
+                                        [seed](const four &left, const four &right, seven &result) {
+                                            result.elem[0] = right.elem[0]; // p(j)
+                                            result.elem[1] = removed(seed, right.elem[0], right.elem[1], right.elem[2]); // d(p(j))
+                                            result.elem[2] = right.elem[3]; // w(p(j))
+                                            result.elem[3] = right.elem[1]; //j = i
+                                            result.elem[4] = left.elem[1]; // n(i)
+                                            result.elem[5] = removed(seed, left.elem[0], left.elem[1], left.elem[2]); // d(i)
+                                            result.elem[6] = left.elem[3]; // w(i)
+                                            return true;
+                                        }), // sorted by result.elem[3]
+                                seven_name, layout.stream_ram(1), layout.stream_ram_size,
+                                [](const seven &src, four &stored) { // the restore never reads n(j), w(j)
+                                    stored.elem[0] = src.elem[0]; // p(j)
+                                    stored.elem[1] = src.elem[2]; // w(p(j))
+                                    stored.elem[2] = src.elem[3]; // j
+                                    stored.elem[3] = src.elem[1] | (src.elem[5] << 1); // d(p(j)) | d(j) << 1
+                                }, packed),
+                        [&previous_size](const seven &src, three &target) {
+                            previous_size++;
+                            if (!src.elem[1] && !src.elem[5]) { // !d(p(j)) && !d(j)
+                                target.elem[0] = src.elem[0]; // p(j)
+                                target.elem[1] = src.elem[3]; // j
+                                target.elem[2] = src.elem[2]; // w(p(j))
+                                return true;
+                            } else if (src.elem[5]) { // d(j)
+                                target.elem[0] = src.elem[0]; // p(j)
+                                target.elem[1] = src.elem[4]; // n(j)
+                                target.elem[2] = src.elem[2] + src.elem[6]; // w(p(j)) + w(j)
+                                return true;
+                            }
+                            return false;
+                        }),
+                weighted_name, layout.stream_ram(2), layout.stream_ram_size, true, packed
         ); // unordered since source was sorted by j and j may be replaced with n(j) sometimes, which is not ordered
 
-        iteration++;
-        if (current_size < (ram_size / sizeof(six))) {
-            break;
+        elements_size_t level_size = previous_size;
+        elements_size_t next_level_size = current_size;
+        if (shards.worker) {
+            level_size = shards.sum(previous_size);
+            next_level_size = shards.sum(current_size);
+            if ((shards.index == 0) && (iteration < shards_t::max_levels)) {
+                shards.shared->level_sizes[iteration][0] = level_size;
+                shards.shared->level_sizes[iteration][1] = next_level_size;
+            }
+        }
+        report.add_level(iteration, level_size, next_level_size);
+
+        // level done once seven(iteration) and weighted(iteration + 1) are durable, weighted(iteration) is not
+        // needed any more
+        checkpoint_t::sync(seven_name);
+        checkpoint_t::sync(weighted_name);
+        seven_sizes.push_back(previous_size);
+        checkpoint.levels = ++iteration;
+        checkpoint.contracted = next_level_size < base_case_size;
+        checkpoint.weighted_size = current_size;
+        checkpoint.min_id = min_id;
+        checkpoint.max_id = max_id;
+        checkpoint.save();
+        if (iteration > 1) {
+            remove(format_name(WEIGHTED_NAME_PATTERN, iteration - 1));
         }
     }
 
     // solve task in RAM
-    {
-        auto *weighted = (three *) ram; // i, n(i), w(i)
-        auto *ranked = (pair *) (ram + ram_size * 3 / 5); // i, r(i)
-        elements_size_t size = 0;
-
-        FILE *weighted_file = fopen(format_name(WEIGHTED_NAME_PATTERN, iteration), "rb");
-        FILE *ranked_file = fopen(format_name(RANKED_NAME_PATTERN, iteration), "wb");
+    if (shards.worker) {
+        // the coordinator ranks what every worker left of the last level, each keeps the ranks of its ids
+        char base_ranked_name[MAX_PATH]{};
 
-        fread(&size, sizeof size, 1, weighted_file);
-        fwrite(&size, sizeof size, 1, ranked_file);
-        fread(weighted, sizeof *weighted, size, weighted_file);
-        qsort(weighted, size, sizeof *weighted, cmp_by<three::element_t, 0>);
-
-        three &cur = weighted[0];
+        snprintf(base_ranked_name, sizeof base_ranked_name, RANKED_NAME_PATTERN, iteration);
+        if (shards.index == 0) {
+            shards.shared->levels = iteration;
+        }
+        shards.send_io();
+        madvise(ram, ram_size, MADV_DONTNEED); // the coordinator's ram is busy instead
+        shards.wait_all(); // every worker contracted
+        shards.wait_all(); // the coordinator wrote ranked(iteration)
+        remove(join_left.c_str());
+        remove(join_right.c_str());
+        remove(join_result.c_str());
+        write_to<pair>(
+                mapper_t<pair, pair>::map(
+                        file_source<pair>(base_ranked_name, layout.stream_ram(0), layout.stream_ram_size),
+                        [&shards](const pair &src, pair &target) {
+                            target = src;
+                            return shards.owner(src.elem[0]) == shards.index;
+                        }),
+                format_name(RANKED_NAME_PATTERN, iteration),
+                layout.stream_ram(1), layout.stream_ram_size); // sorted by i
+    } else if (checkpoint.ranked < 0) {
+        stage_scope_t stage("base_case", iteration);
+        char base_ranked_name[MAX_PATH]{};
 
-        ranked[0].elem[0] = weighted[0].elem[0];
-        ranked[0].elem[1] = 0;
-        for (elements_size_t i = 1; i < size; i++) {
-            ranked[i].elem[0] = cur.elem[1]; // n(i)
-            ranked[i].elem[1] = cur.elem[2] + ranked[i - 1].elem[1]; // w(i) + r(p(i))
+        strcpy(base_ranked_name, format_name(RANKED_NAME_PATTERN, iteration));
+        rank_base_case<id_T>(
+                file_source<three>(weighted_name, layout.stream_ram(0), layout.stream_ram_size),
+                base_ranked_name, ram, ram_size);
 
-            auto next = three{cur.elem[1], 0, 0};
-            cur = *(three *) bsearch(&next, weighted, size, sizeof *weighted, cmp_by<three::element_t, 0>);
+        checkpoint_t::sync(base_ranked_name);
+        checkpoint.ranked = iteration;
+        checkpoint.save();
+        if (iteration > 0) {
+            remove(weighted_name);
         }
-        // sort by i for further join
-        qsort(ranked, size, sizeof *ranked, cmp_by<pair::element_t, 0>);
-        fwrite(ranked, sizeof *ranked, size, ranked_file);
-
-        fclose(weighted_file);
-        fclose(ranked_file);
+        remove(join_result.c_str());
+    } else {
+        iteration = static_cast<uint32_t>(checkpoint.ranked);
     }
 
-    auto curr_rank_joiner = joiner_t<seven, pair, eight>(ram, ram_size);
-    auto prev_rank_joiner = joiner_t<eight, pair, nine>(ram, ram_size);
-    auto eights_sorter = merger_t<eight>(ram, ram_size);
-    auto ranker = mapper_t<nine, pair>(ram, ram_size);
+    // seven(i) holds <p(j), w(p(j)), j, d(p(j)) | d(j) << 1> sorted by j, joins produce only what is read next
+    typedef joiner_t<four, pair, four> curr_rank_joiner;
+    typedef joiner_t<four, pair, pair> prev_rank_joiner;
+    typedef joiner_t<four, pair, five> curr_rank_prober;
+    typedef joiner_t<five, pair, pair> prev_rank_prober;
+
+    typedef hash_table_t<pair, key_by<id_T, 0>> rank_table_t;
+
+    auto by_predecessor_sorter = merger_t<four>(layout.sort_ram, layout.sort_ram_size);
+    char ranked_name[MAX_PATH]{};
+    char next_ranked_name[MAX_PATH]{};
+    // a hash table of ranked(i + 1) gets all ram but the seven stream and the output stream
+    size_t rank_table_ram_size = ram_size - layout.stream_ram_size - base_case_io_size;
+    // once ranked(i) is durable, seven(i) and ranked(i + 1) are not needed any more
+    auto restored = [&]() {
+        checkpoint_t::sync(ranked_name);
+        checkpoint.ranked = iteration;
+        checkpoint.save();
+        remove(seven_name);
+        remove(next_ranked_name);
+    };
 
     // restore ranked(i) from ranked(i + 1) and seven(i)
     while (iteration != 0) {
         iteration--;
+        stage_scope_t stage("restore", iteration);
 
         // assume that ranked are always sorted by i in previous iteration
         // sevens are already sorted by j
-        // <p(j), d(p(j)), w(p(j)), j, n(j), d(j), w(j)> LEFT JOIN <i, r(i)>
-        // INTO <p(j), d(p(j)), w(p(j)), j, n(j), d(j), w(j), r(j)>
         strcpy(seven_name, format_name(SEVEN_NAME_PATTERN, iteration));
+        strcpy(ranked_name, format_name(RANKED_NAME_PATTERN, iteration));
+        strcpy(next_ranked_name, format_name(RANKED_NAME_PATTERN, iteration + 1));
 
-        curr_rank_joiner.join(
-                seven_name,
-                format_name(RANKED_NAME_PATTERN, iteration + 1),
-                JOIN_RESULT_NAME,
-                [](const seven &left, const pair &right, eight &result) {
-                    for (size_t i = 0; i < 7; i++) {
-                        result.elem[i] = left.elem[i];
-                    }
-                    if (left.elem[3] == right.elem[0]) { // j == i
-                        result.elem[7] = right.elem[1]; // r(j) <- r(i)
-                        return true;
-                    }
-                    return false;
+        elements_size_t next_ranked_size = 0;
+        {
+            FILE *next_ranked = fopen(next_ranked_name, "rb");
+            fread(&next_ranked_size, sizeof next_ranked_size, 1, next_ranked);
+            fclose(next_ranked);
+        }
+        if (shards.worker) {
+            next_ranked_size = shards.sum(next_ranked_size);
+        }
+        // ranked(i + 1) fits in memory: r(j) and r(p(j)) are both probed in a hash table, so ranked(i)
+        // comes out sorted by j as the sevens are, with no sort by p(j)
+        if (next_ranked_size <= rank_table_t::capacity(rank_table_ram_size)) {
+            rank_table_t ranks(layout.stream_ram(1), rank_table_ram_size);
+            // p(j) may be in any id range, a worker loads the ranks of every worker
+            for (size_t k = 0; k < (shards.worker ? shards.count : 1); k++) {
+                char shared_name[MAX_PATH]{};
+
+                snprintf(shared_name, sizeof shared_name, RANKED_NAME_PATTERN, iteration + 1);
+                const std::string name = shards.worker ? shards_t::shard_name(shared_name, k) : next_ranked_name;
+                auto next_ranked = file_source<pair>(name.c_str(), layout.stream_ram(0), layout.stream_ram_size);
+                for (pair r{}; next_ranked(r);) {
+                    ranks.insert(r);
                 }
-        );
-        eights_sorter.sort(JOIN_RESULT_NAME, JOIN_LEFT_NAME, cmp_by<eight::element_t, 0>); // by p(j)
-        // <p(j), d(p(j)), w(p(j)), j, n(j), d(j), w(j), r(j)> LEFT JOIN <i, r(i)>
-        // INTO <r(p(j), p(j), d(p(j)), w(p(j)), j, n(j), d(j), w(j), r(j)>
-        prev_rank_joiner.join(
-                JOIN_LEFT_NAME,
-                format_name(RANKED_NAME_PATTERN, iteration + 1),
-                JOIN_RESULT_NAME,
-                [](const eight &left, const pair &right, nine &result) {
-                    for (size_t i = 0; i < 8; i++) {
-                        result.elem[i + 1] = left.elem[i];
-                    }
-                    if (left.elem[0] == right.elem[0]) { // p(j) == i
-                        result.elem[0] = right.elem[1]; // r(p(j)) <- r(i)
+            }
+            if (shards.worker) {
+                shards.wait_workers(); // before ranked(i + 1) is removed
+            }
+
+            // <p(j), w(p(j)), j, d> LEFT JOIN <i, r(i)> ON j = i
+            // LEFT JOIN <i, r(i)> ON p(j) = i INTO <j, r(j)>
+            write_to<pair>(
+                    prev_rank_prober::template hash_join<key_by<id_T, 0>>(
+                            curr_rank_prober::template hash_join<key_by<id_T, 2>>(
+                                    file_source<four>(seven_name, layout.stream_ram(0), layout.stream_ram_size),
+                                    &ranks,
+                                    [](const four &left, const pair *right, five &result) {
+                                        for (size_t i = 0; i < 4; i++) {
+                                            result.elem[i] = left.elem[i];
+                                        }
+                                        result.elem[4] = right ? right->elem[1] : 0; // r(j) unless d(j)
+                                        return true;
+                                    }),
+                            &ranks,
+                            [](const five &left, const pair *right, pair &result) {
+                                result.elem[0] = left.elem[2]; // j
+                                if (!(left.elem[3] & 2)) { // !d(j)
+                                    result.elem[1] = left.elem[4]; // r(j)
+                                } else {
+                                    // r(j) <- r(p(j)) + w(p(j))
+                                    result.elem[1] = (right ? right->elem[1] : 0) + left.elem[1];
+                                }
+                                return true;
+                            }), // sorted by j
+                    ranked_name, base_case_io_ram, base_case_io_size
+            ); // sorted by i
+            restored();
+            continue;
+        }
+
+        // <p(j), w(p(j)), j, d> LEFT JOIN <i, r(i)> ON j = i INTO <p(j), d(p(j)), w(p(j)), r(j)>
+        elements_size_t sevens_size = seven_sizes[iteration];
+        source_t<four> sevens = curr_rank_joiner::left_join(
+                file_source<four>(seven_name, layout.stream_ram(0), layout.stream_ram_size),
+                file_source<pair>(next_ranked_name, layout.stream_ram(1), layout.stream_ram_size),
+                [](const four &left, const pair &right, four &result) {
+                    result.elem[0] = left.elem[0]; // p(j)
+                    result.elem[1] = left.elem[3] & 1; // d(p(j))
+                    result.elem[2] = left.elem[1]; // w(p(j))
+                    if (left.elem[2] == right.elem[0]) { // j == i
+                        result.elem[3] = right.elem[1]; // r(j) <- r(i)
                         return true;
                     }
                     return false;
-                }
-        ); // sorted by p(j)
+                });
+        if (shards.worker) {
+            // the owner of p(j) takes it on
+            {
+                shard_sender_t<four> sender("predecessors", layout.sort_ram, layout.sort_ram_size);
 
-        // MAP <r(p(j)), p(j), d(p(j)), w(p(j)), j, n(j), d(j), w(j), r(j)> TO <i, r(i)>
-        ranker.map(
-                JOIN_RESULT_NAME,
-                format_name(RANKED_NAME_PATTERN, iteration),
-                [](const nine &src, pair &target) {
-                    target.elem[0] = src.elem[1]; // i <- p(j)
-                    if (!src.elem[2]) { // !d(p(j))
-                        target.elem[1] = src.elem[0]; // r(i) <- r(p(j))
-                    } else {
-                        target.elem[1] = src.elem[8] - src.elem[3]; // r(i) <- r(j) - w(p(j))
-                    }
-                    return true;
+                for (four src{}; sevens(src);) {
+                    sender.put(shards.owner(src.elem[0]), src);
                 }
+            }
+            shards.wait_workers();
+            sevens = shard_received<four>("predecessors", layout.stream_ram(2), layout.stream_ram_size, sevens_size);
+        }
+        auto ranked_sevens = by_predecessor_sorter.distributed(
+                sevens, key_by<id_T, 0>(), first_id(), last_id(), sevens_size); // by p(j)
+
+        // <p(j), d(p(j)), w(p(j)), r(j)> LEFT JOIN <i, r(i)> ON p(j) = i INTO <i, r(i)>
+        write_to<pair>(
+                prev_rank_joiner::left_join(
+                        ranked_sevens,
+                        file_source<pair>(next_ranked_name, layout.stream_ram(2), layout.stream_ram_size),
+                        [](const four &left, const pair &right, pair &result) {
+                            result.elem[0] = left.elem[0]; // i <- p(j)
+                            if (!left.elem[1]) { // !d(p(j))
+                                result.elem[1] = right.elem[1]; // r(i) <- r(p(j))
+                            } else {
+                                result.elem[1] = left.elem[3] - left.elem[2]; // r(i) <- r(j) - w(p(j))
+                            }
+                            return left.elem[0] == right.elem[0]; // p(j) == i
+                        }), // sorted by p(j)
+                ranked_name, layout.stream_ram(3), layout.stream_ram_size
         ); // sorted by i
+        restored();
     }
+    if (shards.worker) {
+        shards.send_io();
+        shards.wait_all(); // the coordinator gathers ranked.0
+    }
+}
+
+// ranks the list whose <i, n(i)> records of input_id_T start at input_offset in input on id_T ids, writes
+// input_id_T ids by rank to output
+template<typename id_T, typename input_id_T = id_T>
+static void rank_list(
+        const char *input,
+        long input_offset,
+        elements_size_t input_size,
+        const char *output,
+        char *ram,
+        size_t ram_size) {
+    typedef tuple<id_T, 2> pair;
+
+    const ram_layout_t layout(ram, ram_size);
 
-    uint32_t min_element_rank;
+    rank_nodes<id_T, input_id_T>(input, input_offset, input_size, input, ram, ram_size);
+
+    stage_scope_t output_stage("output", 0);
+    id_T min_element_rank;
     {
-        FILE *ranked = fopen(format_name(RANKED_NAME_PATTERN, iteration), "rb");
-        fseek(ranked, 2 * sizeof(uint32_t), SEEK_SET); // todo: zero-length case
+        FILE *ranked = fopen(format_name(RANKED_NAME_PATTERN, 0), "rb");
+        fseek(ranked, sizeof(elements_size_t) + sizeof(id_T), SEEK_SET); // todo: zero-length case
         fread(&min_element_rank, sizeof min_element_rank, 1, ranked);
         fclose(ranked);
     }
 
-    mapper_t<pair, pair>(ram, ram_size).map(
-            format_name(RANKED_NAME_PATTERN, iteration),
-            JOIN_LEFT_NAME,
-            [min_element_rank](const pair &src, pair &target) {
-                target = src;
-                target.elem[1] -= min_element_rank;
-                return true;
+    // ranks are n consecutive values modulo 2^bits along the list: i goes straight to position
+    // r(i) - r(minimal element), taken mod n. Relative ranks lie in [-n, n) mod 2^bits, so the fold below (and
+    // the fallback sort by r(i) - r(minimal element)) needs n <= 2^(bits - 1); main widens longer lists
+    typedef permuter_t<pair, input_id_T> rank_placer;
+    elements_size_t list_size = input_size;
+    bool placed = rank_placer(layout.stream_ram(1), ram_size - layout.stream_ram_size).permute(
+            file_source<pair>(format_name(RANKED_NAME_PATTERN, 0), layout.stream_ram(0), layout.stream_ram_size),
+            list_size,
+            [min_element_rank, list_size](const pair &src, elements_size_t &pos, input_id_T &target) {
+                id_T rank = src.elem[1] - min_element_rank;
+
+                if (rank >= list_size) { // behind the minimal element
+                    rank += static_cast<id_T>(list_size);
+                }
+                pos = rank;
+                target = static_cast<input_id_T>(src.elem[0]);
+            },
+            output, false);
+    if (!placed) {
+        typedef mapper_t<pair, input_id_T> rank_remover;
+        auto ranked_sorter = merger_t<pair>(layout.sort_ram, layout.sort_ram_size);
+
+        // too many windows for ram: normalize element ranks so that minimal element had rank = 0, sort by r(i)
+        // and keep i only
+        write_to<input_id_T>(
+                rank_remover::map(
+                        ranked_sorter.sorted(
+                                mapper_t<pair, pair>::map(
+                                        file_source<pair>(format_name(RANKED_NAME_PATTERN, 0),
+                                                          layout.stream_ram(0), layout.stream_ram_size),
+                                        [min_element_rank](const pair &src, pair &target) {
+                                            target = src;
+                                            target.elem[1] -= min_element_rank;
+                                            return true;
+                                        }),
+                                key_by<id_T, 1>()), // by r(i)
+                        [](const pair &src, input_id_T &target) {
+                            target = static_cast<input_id_T>(src.elem[0]);
+                            return true;
+                        }),
+                output, layout.stream_ram(1), layout.stream_ram_size, false);
+    }
+    checkpoint_t::sync(output);
+    remove(format_name(RANKED_NAME_PATTERN, 0));
+    checkpoint_t::clear();
+}
+
+#ifndef EXT_NO_MAIN // bench.cpp reuses the operators
+
+// ranks all lists of a forest in one run: the tail of every list is linked to the head of the list with the
+// next list id and the last tail to the first head, so the single list this makes is ranked as usual and every
+// list is a run of consecutive ranks starting at its head
+static void rank_forest(
+        const char *input,
+        long input_offset,
+        elements_size_t input_size,
+        const char *output,
+        char *ram,
+        size_t ram_size) {
+    typedef tuple<uint64_t, 2> pair;
+    typedef tuple<uint64_t, 3> three;
+
+    const ram_layout_t layout(ram, ram_size);
+    uint64_t first_head = 0; // head of the list with the smallest id, it gets rank 0
+
+    {
+        stage_scope_t stage("link", 0);
+        const char *const node_names[] = {FOREST_NODES_NAME, FOREST_SUCCESSORS_NAME}; // by i and by n(i)
+
+        merger_t<three>(layout.sort_ram, layout.sort_ram_size).multi_sort(
+                file_source<three>(input, input_offset, input_size, layout.stream_ram(0), layout.stream_ram_size),
+                node_names, key_by<uint64_t, 0>(), key_by<uint64_t, 1>());
+
+        // heads are the nodes no record points to: <list, i> by list
+        merger_t<pair>(layout.sort_ram, layout.sort_ram_size).sort(
+                joiner_t<three, three, pair>::merge_join<key_by<uint64_t, 0>, key_by<uint64_t, 1>>(
+                        file_source<three>(FOREST_NODES_NAME, layout.stream_ram(0), layout.stream_ram_size),
+                        file_source<three>(FOREST_SUCCESSORS_NAME, layout.stream_ram(1), layout.stream_ram_size),
+                        [](const three &left, const three *right, pair &result) {
+                            result.elem[0] = left.elem[2]; // list
+                            result.elem[1] = left.elem[0]; // i
+                            return right == nullptr;
+                        },
+                        layout.stream_ram(2), layout.stream_ram_size),
+                FOREST_HEADS_NAME, key_by<uint64_t, 0>());
+
+        // tails lead the records sorted by n(i): <list, i> by list
+        auto successors = file_source<three>(FOREST_SUCCESSORS_NAME, layout.stream_ram(0), layout.stream_ram_size);
+        merger_t<pair>(layout.sort_ram, layout.sort_ram_size).sort(
+                [successors](pair &target) {
+                    three src{};
+
+                    if (!successors(src) || (src.elem[1] != 0)) {
+                        return false;
+                    }
+                    target.elem[0] = src.elem[2]; // list
+                    target.elem[1] = src.elem[0]; // i
+                    return true;
+                },
+                FOREST_TAILS_NAME, key_by<uint64_t, 0>());
+
+        // the k-th tail points to the (k + 1)-th head, the last one to the first: <tail, head> by tail
+        auto heads = file_source<pair>(FOREST_HEADS_NAME, layout.stream_ram(0), layout.stream_ram_size);
+        auto tails = file_source<pair>(FOREST_TAILS_NAME, layout.stream_ram(1), layout.stream_ram_size);
+        pair head{};
+
+        heads(head);
+        first_head = head.elem[1];
+        merger_t<pair>(layout.sort_ram, layout.sort_ram_size).sort(
+                [heads, tails, first_head](pair &link) {
+                    pair tail{};
+                    pair next{};
+
+                    if (!tails(tail)) {
+                        return false;
+                    }
+                    link.elem[0] = tail.elem[1];
+                    link.elem[1] = heads(next) ? next.elem[1] : first_head;
+                    return true;
+                },
+                FOREST_LINKS_NAME, key_by<uint64_t, 0>());
+
+        // <i, n(i)> of the one list
+        write_to<pair>(
+                joiner_t<three, pair, pair>::left_join(
+                        file_source<three>(FOREST_NODES_NAME, layout.stream_ram(0), layout.stream_ram_size),
+                        file_source<pair>(FOREST_LINKS_NAME, layout.stream_ram(1), layout.stream_ram_size),
+                        [](const three &left, const pair &right, pair &result) {
+                            result.elem[0] = left.elem[0]; // i
+                            result.elem[1] = left.elem[1]; // n(i)
+                            if (left.elem[0] == right.elem[0]) { // a tail
+                                result.elem[1] = right.elem[1]; // n(i) <- next head
+                                return true;
+                            }
+                            return false;
+                        }),
+                FOREST_LIST_NAME, layout.stream_ram(2), layout.stream_ram_size);
+        remove(FOREST_SUCCESSORS_NAME);
+        remove(FOREST_HEADS_NAME);
+        remove(FOREST_TAILS_NAME);
+        remove(FOREST_LINKS_NAME);
+    }
+
+    rank_nodes<uint64_t>(FOREST_LIST_NAME, sizeof(elements_size_t), input_size, input, ram, ram_size);
+    remove(FOREST_LIST_NAME);
+
+    stage_scope_t output_stage("output", 0);
+    char ranked_name[MAX_PATH]{};
+    uint64_t first_rank = 0;
+
+    strcpy(ranked_name, format_name(RANKED_NAME_PATTERN, 0));
+    {
+        auto ranked = file_source<pair>(ranked_name, layout.stream_ram(0), layout.stream_ram_size);
+        for (pair r{}; ranked(r);) {
+            if (r.elem[0] == first_head) {
+                first_rank = r.elem[1];
+                break;
             }
-    ); // normalize element ranks so that minimal element had rank = 0
-    auto ranked_sorter = merger_t<pair>(ram, ram_size);
-    ranked_sorter.sort(
-            JOIN_LEFT_NAME,
-            JOIN_RESULT_NAME,
-            cmp_by<pair::element_t, 1>
-    ); // by r(i)
-
-    auto rank_remover = mapper_t<pair, uint32_t>(ram, ram_size);
-    rank_remover.write_output_size = false;
-    rank_remover.map(JOIN_RESULT_NAME, output, [](const pair &src, uint32_t &target) {
-        target = src.elem[0];
-        return true;
-    });
+        }
+    }
+
+    // <i, r(i)> JOIN <i, n(i), list> INTO <list, i, r(i)>
+    auto ranked_nodes = [&]() {
+        return joiner_t<pair, three, three>::left_join(
+                file_source<pair>(ranked_name, layout.stream_ram(0), layout.stream_ram_size),
+                file_source<three>(FOREST_NODES_NAME, layout.stream_ram(1), layout.stream_ram_size),
+                [](const pair &left, const three &right, three &result) {
+                    result.elem[0] = right.elem[2]; // list
+                    result.elem[1] = left.elem[0]; // i
+                    result.elem[2] = left.elem[1]; // r(i)
+                    return true;
+                });
+    };
+    auto position = [first_rank, input_size](uint64_t rank) {
+        rank -= first_rank;
+        return (rank >= input_size) ? rank + input_size : rank; // behind the first head
+    };
+    bool placed = permuter_t<three, pair>(layout.stream_ram(2), ram_size - 2 * layout.stream_ram_size).permute(
+            ranked_nodes(),
+            input_size,
+            [position](const three &src, elements_size_t &pos, pair &target) {
+                pos = position(src.elem[2]);
+                target.elem[0] = src.elem[0]; // list
+                target.elem[1] = src.elem[1]; // i
+            },
+            output, false);
+    if (!placed) {
+        // too many windows for ram: sort <position, list, i> by position and keep <list, i>
+        write_to<pair>(
+                mapper_t<three, pair>::map(
+                        merger_t<three>(layout.sort_ram, layout.sort_ram_size).sorted(
+                                mapper_t<three, three>::map(
+                                        ranked_nodes(),
+                                        [position](const three &src, three &target) {
+                                            target.elem[0] = position(src.elem[2]);
+                                            target.elem[1] = src.elem[0]; // list
+                                            target.elem[2] = src.elem[1]; // i
+                                            return true;
+                                        }),
+                                key_by<uint64_t, 0>()),
+                        [](const three &src, pair &target) {
+                            target.elem[0] = src.elem[1]; // list
+                            target.elem[1] = src.elem[2]; // i
+                            return true;
+                        }),
+                output, layout.stream_ram(2), layout.stream_ram_size, false);
+    }
+    checkpoint_t::sync(output);
+    remove(ranked_name);
+    remove(FOREST_NODES_NAME);
+    checkpoint_t::clear();
+}
+
+// a shard worker ranks the levels of every job the coordinator posts, each in its share of the memory budget
+static void serve_shard() {
+    shards_t &shards = shards_t::instance();
+    const shards_t::job_t &job = shards.shared->job;
+    size_t ram_size = cost_model_t::instance().memory_size / shards.count;
+
+    checkpoint_t::enabled() = false;
+    checkpoint_t::resume() = false;
+    run_report_t::instance().progress = false;
+    run_report_t::instance().name.clear();
+    while (true) {
+        shards.wait_all();
+        if (job.quit) {
+            exit(EXIT_SUCCESS);
+        }
+        auto *ram = (char *) mmap(nullptr, ram_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ram == MAP_FAILED) {
+            shards.fail();
+        }
+        if (job.id_bits == 32) {
+            rank_nodes<uint32_t>(job.input, job.input_offset, job.input_size, job.input, ram, ram_size);
+        } else if (job.input_id_bits == 32) {
+            rank_nodes<uint64_t, uint32_t>(job.input, job.input_offset, job.input_size, job.input, ram, ram_size);
+        } else {
+            rank_nodes<uint64_t>(job.input, job.input_offset, job.input_size, job.input, ram, ram_size);
+        }
+        munmap(ram, ram_size);
+    }
+}
+
+int main(int argc, char const *argv[]) {
+    const char *input = DEFAULT_INPUT_PATTERN;
+    const char *output = DEFAULT_OUTPUT;
+    cost_model_t::instance().configure(argc, argv);
+    checkpoint_t::configure(argc, argv);
+    run_report_t::instance().configure(argc, argv);
+    if (shards_t::instance().start(cost_model_t::instance().shards)) {
+        serve_shard();
+    }
+    cost_model_t::instance().calibrate(input);
+    size_t ram_size = cost_model_t::instance().memory_size;
+    auto *ram = new char[ram_size];
+    uint32_t header = 0;
+    uint64_t wide_size = 0;
+
+    FILE *in = fopen(input, "rb");
+    fread(&header, sizeof header, 1, in);
+    if ((header == WIDE_INPUT_MARK) || (header == FOREST_INPUT_MARK)) {
+        fread(&wide_size, sizeof wide_size, 1, in);
+    }
+    fclose(in);
+
+    // 32-bit ids stay the compact default up to 2^31 nodes, longer 32-bit lists are ranked on 64-bit ids so
+    // that relative ranks fold back unambiguously; WIDE_INPUT_MARK switches every record to 64-bit ids
+    if (header == FOREST_INPUT_MARK) {
+        rank_forest(input, sizeof header + sizeof wide_size, wide_size, output, ram, ram_size);
+    } else if (header == WIDE_INPUT_MARK) {
+        rank_list<uint64_t>(input, sizeof header + sizeof wide_size, wide_size, output, ram, ram_size);
+    } else {
+        if (header > (1u << 31)) {
+            rank_list<uint64_t, uint32_t>(input, sizeof header, header, output, ram, ram_size);
+        } else {
+            rank_list<uint32_t>(input, sizeof header, header, output, ram, ram_size);
+        }
+    }
+    shards_t::instance().stop();
+    run_report_t::instance().write();
 
     delete[] ram;
     return 0;
-}
\ No newline at end of file
+}
+
+#endif
@@ -15,7 +15,7 @@ AR="output.bin"
 
 bsort=/home/nikita/Programs/bsort/src/bsort
 
-./test_gen.out $1
+./test_gen.out "$@" || exit 1
 
 START_TIME="$(date -u +%s.%N)"
 ./ext_join.out
@@ -40,11 +40,11 @@ fi
 
 if [[ ${RC} -ne 0 ]]
 then
-    echo -e "[${RED} WA  ${NC}]\tfor ${1}"
+    echo -e "[${RED} WA  ${NC}]\tfor ${*}"
     cp ./input.bin ./tests/input.bin.$(date +%N)
 elif [[ $(bc <<<"$ELAPSED>15") -eq 1 ]]
 then
-    echo -e "[${ORANGE} TLE ${NC}]\t ${ELAPSED}s for ${1}"
+    echo -e "[${ORANGE} TLE ${NC}]\t ${ELAPSED}s for ${*}"
 else
-    echo -e "[${GREEN} OK  ${NC}]\t ${ELAPSED}s for ${1}"
+    echo -e "[${GREEN} OK  ${NC}]\t ${ELAPSED}s for ${*}"
 fi
\ No newline at end of file
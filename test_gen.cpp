@@ -12,75 +12,336 @@
 #define DEFAULT_INPUT_PATTERN ("input.bin")
 #define DEFAULT_OUTPUT ("output.expected.bin")
 
+#define WIDE_INPUT_MARK 0xffffffffu
+#define FOREST_INPUT_MARK 0xfffffffeu
+#define WIDE_ID_BASE (uint64_t(1) << 33) // wide ids start beyond 2^32 to exercise the 64-bit path
+#define LOCAL_WINDOW 4096
 
-template<typename element_T, size_t len>
-struct tuple {
-    element_T elem[len];
+// list of size n is generated position by position, p = 0..n-1, n(p) = p + 1 mod n; every shape is
+// a pair of bijections on [0, n): node id of a position, and position of the k-th input record.
+// Nothing of size n is held in memory, so inputs may be far larger than RAM
+enum shape_t {
+    RANDOM,   // ids and record order are both random permutations
+    LOCAL,    // ids and records shuffled only within windows of LOCAL_WINDOW consecutive nodes
+    SORTED,   // n(i) = i + 1, records by i
+    REVERSED, // n(i) = i - 1, records by i descending
+    STRIDED   // n(i) = i + stride mod n, records by list order: neighbours are far apart in both
 };
 
-template<typename element_T, size_t idx>
-static int cmp_by(const void *l, const void *r) {
-    auto *lhs = (element_T *) l;
-    auto *rhs = (element_T *) r;
+static const char *const shape_names[] = {"random", "local", "sorted", "reversed", "strided"};
 
-    return lhs[idx] - rhs[idx];
+static uint64_t mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// random bijection on [0, size): 4-round Feistel network over the smallest even power of two
+// that covers size, cycle-walking the values that fall outside (fewer than 4 steps on average)
+struct permutation_t {
+    uint64_t size;
+    uint64_t seed;
+    unsigned half_bits;
+
+    permutation_t(uint64_t size, uint64_t seed) : size(size), seed(seed), half_bits(1) {
+        while ((half_bits < 32) && ((uint64_t(1) << (2 * half_bits)) < size)) {
+            half_bits++;
+        }
+    }
+
+    uint64_t operator()(uint64_t x) const {
+        do {
+            x = feistel(x);
+        } while (x >= size);
+        return x;
+    }
+
+    // x such that (*this)(x) == y, walking the same cycle backwards
+    uint64_t inverse(uint64_t y) const {
+        do {
+            y = feistel_inverse(y);
+        } while (y >= size);
+        return y;
+    }
+
+private:
+    uint64_t feistel(uint64_t x) const {
+        const uint64_t mask = (uint64_t(1) << half_bits) - 1;
+        uint64_t l = x >> half_bits;
+        uint64_t r = x & mask;
+
+        for (uint64_t round = 0; round < 4; round++) {
+            uint64_t next = l ^ (mix(seed + round * 0x9e3779b97f4a7c15ull + r) & mask);
+            l = r;
+            r = next;
+        }
+        return (l << half_bits) | r;
+    }
+
+    uint64_t feistel_inverse(uint64_t x) const {
+        const uint64_t mask = (uint64_t(1) << half_bits) - 1;
+        uint64_t l = x >> half_bits;
+        uint64_t r = x & mask;
+
+        for (uint64_t round = 4; round-- > 0;) {
+            uint64_t prev = r ^ (mix(seed + round * 0x9e3779b97f4a7c15ull + l) & mask);
+            r = l;
+            l = prev;
+        }
+        return (l << half_bits) | r;
+    }
+};
+
+// same as permutation_t, applied independently to consecutive windows of the given size
+struct local_permutation_t {
+    uint64_t size;
+    uint64_t window;
+    permutation_t inner;
+    permutation_t last;
+
+    local_permutation_t(uint64_t size, uint64_t window, uint64_t seed) :
+            size(size), window(window), inner(window, seed), last(size % window, seed) {
+    }
+
+    uint64_t operator()(uint64_t x) const {
+        uint64_t base = x - x % window;
+
+        return base + ((base + window <= size) ? inner(x - base) : last(x - base));
+    }
+};
+
+struct generator_t {
+    shape_t shape;
+    uint64_t size;
+    permutation_t id_perm;
+    permutation_t record_perm;
+    local_permutation_t local_id_perm;
+    local_permutation_t local_record_perm;
+    uint64_t stride;
+
+    generator_t(shape_t shape, uint64_t size, uint64_t seed) :
+            shape(shape), size(size),
+            id_perm(size, mix(seed)), record_perm(size, mix(seed + 1)),
+            local_id_perm(size, LOCAL_WINDOW, mix(seed + 2)), local_record_perm(size, LOCAL_WINDOW, mix(seed + 3)),
+            stride(1) {
+        // a stride coprime with size, near size / golden ratio
+        for (stride = std::max<uint64_t>(1, uint64_t(size * 0.6180339887)); gcd(stride, size) != 1; stride++) {
+        }
+    }
+
+    // 0-based id of the node at list position p
+    uint64_t id(uint64_t p) const {
+        switch (shape) {
+            case LOCAL:
+                return local_id_perm(p);
+            case SORTED:
+                return p;
+            case REVERSED:
+                return size - 1 - p;
+            case STRIDED:
+                return static_cast<uint64_t>((unsigned __int128) p * stride % size);
+            default:
+                return id_perm(p);
+        }
+    }
+
+    // list position of the k-th input record
+    uint64_t position(uint64_t k) const {
+        switch (shape) {
+            case LOCAL:
+                return local_record_perm(k);
+            case SORTED:
+            case REVERSED:
+            case STRIDED:
+                return k;
+            default:
+                return record_perm(k);
+        }
+    }
+
+private:
+    static uint64_t gcd(uint64_t a, uint64_t b) {
+        return b ? gcd(b, a % b) : a;
+    }
+};
+
+// fixed-size buffer flushed with one fwrite per block
+struct block_writer_t {
+    FILE *file;
+    char *buf;
+    size_t used;
+
+    explicit block_writer_t(const char *name) : file(fopen(name, "wb")), buf(new char[DEFAULT_BLOCK_SIZE]), used(0) {
+    }
+
+    ~block_writer_t() {
+        flush();
+        fclose(file);
+        delete[] buf;
+    }
+
+    void put(const void *data, size_t size) {
+        if (used + size > DEFAULT_BLOCK_SIZE) {
+            flush();
+        }
+        memcpy(buf + used, data, size);
+        used += size;
+    }
+
+    void put_id(uint64_t id, bool wide) {
+        if (wide) {
+            id += WIDE_ID_BASE;
+            put(&id, sizeof id);
+        } else {
+            auto narrow = static_cast<uint32_t>(id);
+            put(&narrow, sizeof narrow);
+        }
+    }
+
+    void flush() {
+        fwrite(buf, 1, used, file);
+        used = 0;
+    }
+};
+
+// the list positions cut into lists consecutive segments, segment m starts at floor(m * size / lists);
+// list ids are a random permutation of the segments
+struct forest_t {
+    uint64_t size;
+    uint64_t lists;
+    permutation_t list_perm;
+
+    forest_t(uint64_t size, uint64_t lists, uint64_t seed) : size(size), lists(lists), list_perm(lists, mix(seed + 4)) {
+    }
+
+    uint64_t start(uint64_t m) const {
+        return static_cast<uint64_t>((unsigned __int128) m * size / lists);
+    }
+
+    uint64_t segment(uint64_t p) const {
+        return static_cast<uint64_t>(((unsigned __int128) (p + 1) * lists - 1) / size);
+    }
+
+    // 1-based list id of segment m
+    uint64_t list(uint64_t m) const {
+        return list_perm(m) + 1;
+    }
+
+    // segment of 1-based list id l
+    uint64_t segment_of(uint64_t l) const {
+        return list_perm.inverse(l - 1);
+    }
+};
+
+// lists of <i, n(i), list> records, n(i) = 0 ends a list; the expected output is <list, i> by list id,
+// every list from its head
+static void write_forest(const generator_t &gen, uint64_t size, uint64_t lists, uint64_t seed) {
+    forest_t forest(size, lists, seed);
+    {
+        block_writer_t input(DEFAULT_INPUT_PATTERN);
+        uint32_t mark = FOREST_INPUT_MARK;
+
+        input.put(&mark, sizeof mark);
+        input.put(&size, sizeof size);
+        for (uint64_t k = 0; k < size; k++) {
+            uint64_t p = gen.position(k);
+            uint64_t m = forest.segment(p);
+            uint64_t record[] = {
+                    gen.id(p) + 1,
+                    (p + 1 < forest.start(m + 1)) ? gen.id(p + 1) + 1 : 0,
+                    forest.list(m)};
+            input.put(record, sizeof record);
+        }
+    }
+
+    block_writer_t output(DEFAULT_OUTPUT);
+    for (uint64_t l = 0; l < lists; l++) {
+        uint64_t m = forest.segment_of(l + 1);
+
+        for (uint64_t p = forest.start(m); p < forest.start(m + 1); p++) {
+            uint64_t record[] = {l + 1, gen.id(p) + 1};
+            output.put(record, sizeof record);
+        }
+    }
 }
 
 int main(int argc, char const *argv[])
 {
-    FILE *input = fopen(DEFAULT_INPUT_PATTERN, "wb");
-    FILE *output = fopen(DEFAULT_OUTPUT, "wb");
-    uint32_t size;
+    uint64_t size;
+    shape_t shape = RANDOM;
+    bool wide = false;
+    uint64_t lists = 0;
     std::random_device rd;
-    std::mt19937 mt(rd());
-    std::uniform_int_distribution<uint64_t> uid;
-
+    uint64_t seed = (uint64_t(rd()) << 32) | rd();
 
     if (argc < 2) {
-        fprintf(stderr, "Usage: ./test_gen.out <file_size>\n");
+        fprintf(stderr, "Usage: ./test_gen.out <file_size> [random|local|sorted|reversed|strided] [--wide] "
+                        "[--seed=<seed>] [--lists=<lists>]\n");
         return EXIT_FAILURE;
     }
 
-    size = strtoul(argv[1], nullptr, 10);
-
-    setvbuf(output, nullptr, _IOFBF, DEFAULT_BLOCK_SIZE);
-    setvbuf(input, nullptr, _IOFBF, DEFAULT_BLOCK_SIZE);
-    fwrite(&size, sizeof size, 1, input);
-    auto *list = new uint32_t[size]();
-    auto *edges = new uint32_t[2 * size]();
-
-    for (size_t i = 0; i < size; i++) {
-        list[i] = uint32_t(i + 1);
+    size = strtoull(argv[1], nullptr, 10);
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "--wide")) {
+            wide = true;
+        } else if (!strncmp(argv[i], "--seed=", 7)) {
+            seed = strtoull(argv[i] + 7, nullptr, 10);
+        } else if (!strncmp(argv[i], "--lists=", 8)) {
+            lists = strtoull(argv[i] + 8, nullptr, 10);
+        } else {
+            auto name = std::find_if(std::begin(shape_names), std::end(shape_names),
+                                     [&](const char *s) { return !strcmp(s, argv[i]); });
+            if (name == std::end(shape_names)) {
+                fprintf(stderr, "Unknown shape %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            shape = static_cast<shape_t>(name - std::begin(shape_names));
+        }
+    }
+    if (size == 0 || (!wide && (lists == 0) && size >= FOREST_INPUT_MARK)) {
+        fprintf(stderr, "Size must be in [1, 2^32 - 2) or use --wide\n");
+        return EXIT_FAILURE;
     }
-    std::shuffle(list, list + size, mt);
 
-    for (size_t i = 0; i < size; i++) {
-        edges[2 * i] = list[i];
-        edges[2 * i + 1] = list[(i + 1) % size];
+    if (lists > size) {
+        fprintf(stderr, "Lists must not outnumber nodes\n");
+        return EXIT_FAILURE;
     }
 
-    auto *compressed_edges = (uint64_t *) edges;
-    std::shuffle(compressed_edges, compressed_edges + size, mt);
+    generator_t gen(shape, size, seed);
+    if (lists != 0) {
+        write_forest(gen, size, lists, seed);
+        return EXIT_SUCCESS;
+    }
+    {
+        block_writer_t input(DEFAULT_INPUT_PATTERN);
 
-    auto min_elem = *list;
-    size_t min_elem_idx = 0;
-    for (uint64_t i = 1; i < size; i++) {
-        if (list[i] < min_elem) {
-            min_elem = list[i];
-            min_elem_idx = i;
+        if (wide) {
+            uint32_t mark = WIDE_INPUT_MARK;
+            input.put(&mark, sizeof mark);
+            input.put(&size, sizeof size);
+        } else {
+            auto narrow = static_cast<uint32_t>(size);
+            input.put(&narrow, sizeof narrow);
+        }
+        for (uint64_t k = 0; k < size; k++) {
+            uint64_t p = gen.position(k);
+            input.put_id(gen.id(p) + 1, wide);
+            input.put_id(gen.id((p + 1) % size) + 1, wide);
         }
     }
 
-    for (uint64_t i = 0; i < size; i++) {
-        fwrite(edges + 2 * i, sizeof *edges, 1, input);
-        fwrite(edges + 2 * i + 1, sizeof *edges, 1, input);
-        fwrite(list + (min_elem_idx + i) % size, sizeof *list, 1, output);
+    // expected output: ids in list order, starting from the minimal one
+    uint64_t min_elem_pos = 0;
+    while (gen.id(min_elem_pos) != 0) {
+        min_elem_pos++;
     }
+    {
+        block_writer_t output(DEFAULT_OUTPUT);
 
-    fclose(input);
-    fclose(output);
-
-    delete[] list;
-    delete[] edges;
+        for (uint64_t i = 0; i < size; i++) {
+            output.put_id(gen.id((min_elem_pos + i) % size) + 1, wide);
+        }
+    }
     return EXIT_SUCCESS;
 }